@@ -4,6 +4,7 @@
  * Features:
  * - 4 IR Sensors for parking slot detection (4 slots)
  * - 1 Servo motor for entrance gate control
+ * - 1 IR beam under the gate barrier (obstruction detection)
  * - 4x4 Keypad for voucher input
  * - 1 LED Indicator for reserved slot tracking
  * - 1 Buzzer for wrong slot detection
@@ -17,9 +18,12 @@
  *   Slot 3 → GPIO 21
  *   Slot 4 → GPIO 22
  * 
- * Servo Motor (PWM supported pins)
+ * Servo Motor (LEDC hardware PWM, 50 Hz)
  *   Entrance Gate → GPIO 26
  * 
+ * Gate Beam IR Sensor (Active LOW = something under the barrier)
+ *   Gate Beam → GPIO 13
+ * 
  * LED Indicator Pin
  *   Indicator LED → GPIO 2 (lights up when voucher valid, turns off when vehicle arrives at correct slot)
  * 
@@ -51,24 +55,89 @@
  * Notes:
  * - All GND must be COMMON Ground
  * - Supply servo with external 5V if powerful servo is used
+ * - Every outbound message (HTTP, MQTT, local UDP) carries a per-channel
+ *   sequence number `seq`, the SNTP wall-clock time `ts` (epoch ms, 0 until
+ *   synced) of the originating edge event, and the admission `traceId`
+ *   (voucher → gate → slot) so the backend can compute per-hop latency
+ * - Full lot state (slots, gate, LED, buzzer, reservation) is kept as one
+ *   versioned document, published retained on "parking/state" on every MQTT
+ *   connect, after every change (bursts coalesced by STATE_PUBLISH_COALESCE)
+ *   and every STATE_REFRESH_INTERVAL, so a retained copy's `ts` shows its age
+ * - Backend requests go through a pluggable BackendTransport: HTTPS (default)
+ *   or CoAP over UDP with DTLS-PSK (BACKEND_TRANSPORT_COAP), confirmable for
+ *   commands (voucher) and non-confirmable for telemetry (sensor, servo).
+ *   TRANSPORT_BENCHMARK compares HTTP / CoAP / MQTT round trips and bytes
+ *   against backend/scripts/coap-standin.js on the LAN
+ * - Gate FSM: CLOSED → OPENING → OPEN → CLOSING → CLOSED, plus BLOCKED
+ *   (held open while the gate beam is obstructed). Moves are trapezoidal
+ *   motion profiles played by LEDC hardware fades; a beam edge (GPIO
+ *   interrupt) while CLOSING reverses the gate. Cycle time and vehicles/hour
+ *   are reported in the state snapshot ("gateMetrics")
+ * - Warm restart: reservation, LED, buzzer, gate and trace state are kept in
+ *   RTC memory (survives software/watchdog/brownout resets) with an NVS copy
+ *   as fallback; the NVS reservation is only kept if SNTP shows the outage
+ *   was short (PERSIST_NVS_MAX_AGE_SEC). Hardware and sensing start
+ *   immediately on boot while WiFi comes up in TaskWifiMqtt; reset reason,
+ *   boot-to-gate-ready and boot-to-first-sensor-report times go to Serial
+ *   and "parking/device/boot"
+ * - Gate auto-close, MQTT reconnect backoff, metrics flush and sensor debounce
+ *   are deadline timers on one scheduler task instead of separate polling tasks.
+ *   Timer callbacks never block: backend calls, MQTT publishes and flash
+ *   writes they trigger are queued to TaskNetWorker
+ * - Tasks, sync objects and request buffers are allocated statically and the
+ *   sketch's own code avoids String; library internals still allocate per
+ *   request (HTTPClient URL/headers, errorToString, mbedTLS records), so heap
+ *   use is bounded rather than zero. Set HEAP_INVARIANT_CHECK to 1 to verify
+ *   free heap stays flat after warm-up and print task stack high-water marks
  * - MQTT Broker: HiveMQ Cloud (TLS on port 8883)
  * - Designed to work with backend base path `/api/v1`
  *    validate voucher → /api/v1/iot/validate
  *    update sensor   → /api/v1/iot/sensor-update
  *    servo callback  → /api/v1/iot/servo-callback
+ * - Optional local control plane (LOCAL_CONTROL_ENABLED, off by default; plain
+ *   HTTP, so only enable it on a trusted LAN), works without the WAN link:
+ *    GET  http://<esp32-ip>/slots       → full state document (same as parking/state)
+ *    POST http://<esp32-ip>/gate/open   → open gate  (x-local-token required)
+ *    POST http://<esp32-ip>/gate/close  → close gate (x-local-token required)
+ *    UDP broadcast on LOCAL_UDP_PORT    → {"type":"slot"|"gate",...} on every change
  */
 
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 #include <HTTPClient.h>
 #include <PubSubClient.h>
-#include <ESP32Servo.h>
 #include <Keypad.h>
 #include <ArduinoJson.h>
+#include <time.h>
+#include <sys/time.h>
+#include <math.h>
+
+// ======== Warm-restart persistence + boot timing ========
+#include <Preferences.h>
+#include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include <stddef.h>
+
+// ======== LEDC (hardware PWM + fades for the gate servo) ========
+#include "driver/ledc.h"
 
 // ======== FreeRTOS (Task Management) ========
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+
+// ======== lwIP sockets (local control plane) ========
+#include "lwip/sockets.h"
+#include <errno.h>
+
+// ======== mbedTLS (DTLS for the CoAP transport) ========
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/net_sockets.h"
 
 // ==================== CONFIGURATION ====================
 
@@ -85,6 +154,61 @@
 // Backend API Configuration
 #define BACKEND_API_BASE "https://parqeer-smart-iot-parking-production.up.railway.app/api/v1"
 #define DEVICE_TOKEN "parqeer-device-8f2d1c7b4a"
+#define DEVICE_ID "esp32-main"
+
+// Local control plane for LAN clients (kiosk / attendant tablet)
+#define LOCAL_CONTROL_ENABLED 0
+#define LOCAL_HTTP_PORT 80
+#define LOCAL_UDP_PORT 4210
+// Own credential: travels in cleartext on the LAN, never reuse DEVICE_TOKEN
+#define LOCAL_CONTROL_TOKEN "parqeer-local-change-me"
+
+// SNTP (wall-clock timestamps for latency tracing)
+#define NTP_SERVER_1 "pool.ntp.org"
+#define NTP_SERVER_2 "time.google.com"
+#define NTP_GMT_OFFSET_SEC (7 * 3600)     // WIB, only affects Serial log format
+
+// Backend transport: 0 = HTTPS to BACKEND_API_BASE, 1 = CoAP/UDP to COAP_HOST
+// (a CoAP→HTTP proxy in front of the backend; Railway does not route UDP)
+#define BACKEND_TRANSPORT_COAP 0
+#define COAP_HOST "coap.parqeer.local"
+#define COAP_PORT 5684                    // 5684 = coaps (DTLS), 5683 = plain coap
+#define COAP_DTLS_ENABLED 1
+#define COAP_PSK_IDENTITY DEVICE_ID
+#define COAP_PSK_KEY "parqeer-coap-psk-3e91a7c2"
+#define COAP_URI_PREFIX "/api/v1"         // same paths as the HTTP API
+
+#if BACKEND_TRANSPORT_COAP && COAP_DTLS_ENABLED && !(defined(MBEDTLS_SSL_PROTO_DTLS) && defined(MBEDTLS_KEY_EXCHANGE_PSK_ENABLED))
+#error "CoAP over DTLS needs mbedTLS built with DTLS and PSK key exchange"
+#endif
+
+// Transport benchmark (diagnostic): run `node scripts/coap-standin.js` in
+// backend/ on a LAN machine, point BENCH_HOST at it and read [BENCH] lines.
+// All three legs (HTTP, CoAP, MQTT) hit that one stand-in in plain text, so
+// latency and byte counts are comparable.
+#define TRANSPORT_BENCHMARK 0
+#define BENCH_HOST "192.168.1.10"
+#define BENCH_HTTP_BASE "http://" BENCH_HOST ":8080" COAP_URI_PREFIX
+#define BENCH_COAP_PORT 5683
+#define BENCH_MQTT_PORT 1883
+#define BENCH_ITERATIONS 50
+#define BENCH_MQTT_TOPIC "parking/bench/" DEVICE_ID
+
+// Diagnostic mode: 1 = assert free heap stays flat after boot + heap tracing
+#define HEAP_INVARIANT_CHECK 0
+#define HEAP_INVARIANT_TOLERANCE 256      // bytes of drift allowed (lwIP/TLS pools)
+#define HEAP_INVARIANT_WARMUP_MS 60000    // baseline taken this long after first MQTT connect
+#define HEAP_TRACE_RECORDS 64
+
+// Leak tracing needs CONFIG_HEAP_TRACING_STANDALONE, which the stock Arduino
+// sdkconfig does not set (rebuild the core libs / use arduino-as-component).
+// Without it the invariant check still runs, just without a trace dump.
+#if HEAP_INVARIANT_CHECK && defined(CONFIG_HEAP_TRACING_STANDALONE)
+#define HEAP_TRACE_AVAILABLE 1
+#include "esp_heap_trace.h"
+#else
+#define HEAP_TRACE_AVAILABLE 0
+#endif
 
 // ==================== HARDWARE PINS ====================
 
@@ -94,15 +218,27 @@ const int irSensorPins[4] = {18, 19, 21, 22};
 // Entrance Gate Servo Motor Pin
 const int gateServoPin = 26;  // Changed from 26 to avoid keypad conflict
 
+// Gate beam IR sensor under the barrier (Active LOW - obstructed)
+const int gateBeamPin = 13;
+
 // Wrong-slot indicator LED Pin
 const int indicatorLedPin = 2;
 
 // Buzzer Pin
 const int buzzerPin = 23;
 
-// Servo Positions
+// Servo Positions (degrees) and pulse range
 const int SERVO_CLOSED = 90;
 const int SERVO_OPEN = 0;
+const int SERVO_MIN_PULSE_US = 500;    // 0°
+const int SERVO_MAX_PULSE_US = 2500;   // 180°
+const int SERVO_PWM_HZ = 50;
+
+// LEDC resources for the gate servo
+const ledc_mode_t GATE_LEDC_MODE = LEDC_LOW_SPEED_MODE;
+const ledc_timer_t GATE_LEDC_TIMER = LEDC_TIMER_0;
+const ledc_channel_t GATE_LEDC_CHANNEL = LEDC_CHANNEL_0;
+const ledc_timer_bit_t GATE_LEDC_RESOLUTION = LEDC_TIMER_14_BIT;
 
 // Keypad Configuration
 const byte ROWS = 4;
@@ -120,23 +256,40 @@ byte colPins[COLS] = {14, 27, 33};
 
 WiFiClientSecure wifiClient;
 PubSubClient mqttClient(wifiClient);
-Servo gateServo;
 Keypad keypad = Keypad(makeKeymap(keys), rowPins, colPins, ROWS, COLS);
 
 // ==================== VARIABLES ====================
 
-String voucherCode = "";
 bool sensorStates[4] = {false, false, false, false};
-unsigned long lastSensorCheck[4] = {0, 0, 0, 0};
-unsigned long lastMqttReconnect = 0;
+volatile bool sensorDebouncing[4] = {false, false, false, false};
+// True only for the setup() pass: every occupied slot shows up as an edge
+// from the all-false initial state, which is not a car entering it
+bool sensorBootPass = false;
+// Slots (bit = index) whose last /iot/sensor-update never reached the backend,
+// e.g. every change seen by the boot pass, before WiFi is up. TaskSensors
+// re-sends their current state; the edge time is lost, so ts = 0.
+uint8_t slotReportPending = 0;
+unsigned long slotReportRetryAt = 0;
+const unsigned long SLOT_REPORT_RETRY = 5000;
 
 const unsigned long SENSOR_DEBOUNCE = 2000;
 const unsigned long MQTT_RECONNECT_INTERVAL = 5000;
+const unsigned long MQTT_RECONNECT_MAX_INTERVAL = 60000;
+const unsigned long METRICS_FLUSH_INTERVAL = 5000;
+const unsigned long STATE_PUBLISH_COALESCE = 20;
+const unsigned long STATE_REFRESH_INTERVAL = 300000;  // republish unchanged state so its age bounds staleness
+const unsigned long PERSIST_NVS_COALESCE = 500;
+const unsigned long PERSIST_NVS_HEARTBEAT = 300000;   // re-stamp NVS while a reservation/open gate is live
+const uint32_t PERSIST_NVS_MAX_AGE_SEC = 900;         // older NVS reservation = outage too long, dropped
+const unsigned long PERSIST_CLOCK_WAIT = 60000;       // give up dating the NVS copy without SNTP
 const unsigned long SERVO_AUTO_CLOSE_DELAY = 5000;
+const unsigned long GATE_MOTION_MS = 1200;         // full CLOSED ↔ OPEN travel
+const unsigned long GATE_BEAM_CLEAR_DELAY = 1500;  // BLOCKED → CLOSING after the beam clears
 const int VOUCHER_LENGTH = 6;
 
-bool gateServoOpen = false;
-unsigned long gateServoOpenTime = 0;
+char voucherCode[VOUCHER_LENGTH + 1] = "";
+int voucherCodeLength = 0;
+
 bool indicatorLedOn = false;
 
 // LED Tracking variables
@@ -148,41 +301,459 @@ bool ledActiveForReservedSlot = false; // Apakah LED sedang aktif untuk slot res
 bool buzzerActive = false;             // Apakah buzzer sedang aktif
 unsigned long buzzerActivationTime = 0; // Waktu buzzer dinyalakan
 
+// Full-state document version, bumped on every slot/gate/LED/buzzer change
+// (from both cores: mqttCallback, sensors, keypad, scheduler)
+volatile uint32_t stateVersion = 0;
+portMUX_TYPE stateVersionMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Request buffers (sized for the largest payload each path sends/receives)
+const size_t HTTP_URL_SIZE      = 128;
+const size_t COAP_MAX_MESSAGE   = 384;
+const size_t HTTP_BODY_SIZE     = 256;
+const size_t HTTP_RESPONSE_SIZE = 256;
+const size_t LOCAL_REQUEST_SIZE = 512;
+const size_t STATE_SNAPSHOT_SIZE = 576;
+
+// ==================== TRACING ====================
+
+// Separate sequence per channel so the backend can spot gaps per path
+enum MessageChannel {
+  CHANNEL_HTTP,
+  CHANNEL_MQTT,
+  CHANNEL_LOCAL,
+  CHANNEL_COUNT
+};
+
+uint32_t messageSeq[CHANNEL_COUNT] = {0, 0, 0};
+char currentTraceId[17] = "";            // "" = no admission in progress
+portMUX_TYPE traceMux = portMUX_INITIALIZER_UNLOCKED;
+
+// ==================== PERSISTENCE ====================
+
+// Controller state that must survive a reset (brownout from the servo in
+// the middle of an admission). CRC covers everything before `crc`.
+const uint32_t PERSIST_MAGIC = 0x50515232;   // "PQR2"
+
+struct PersistedState {
+  uint32_t magic;
+  int8_t reservedSlot;
+  uint8_t ledActive;
+  uint8_t buzzerActive;
+  uint8_t gateOpen;                          // anything but CLOSED
+  char traceId[17];
+  uint32_t savedAtSec;                       // epoch of the NVS write (0 = clock unsynced / RTC copy)
+  uint32_t crc;
+};
+
+// RTC copy also carries the message sequences (bumped per message, so they
+// stay outside the CRC and are never written to flash)
+struct RtcState {
+  PersistedState state;
+  uint32_t messageSeq[CHANNEL_COUNT];
+};
+
+RTC_NOINIT_ATTR RtcState rtcState;
+PersistedState nvsState;                     // last copy written to NVS
+PersistedState nvsPendingState;              // NVS reservation waiting for SNTP to be dated
+bool nvsRestorePending = false;
+Preferences preferences;
+portMUX_TYPE persistMux = portMUX_INITIALIZER_UNLOCKED;
+
+enum RestoreSource {
+  RESTORE_NONE,
+  RESTORE_RTC,
+  RESTORE_NVS
+};
+
+const char* const RESTORE_SOURCE_NAMES[] = {"none", "rtc", "nvs"};
+RestoreSource restoreSource = RESTORE_NONE;
+esp_reset_reason_t resetReason = ESP_RST_UNKNOWN;
+
+// Boot milestones (µs since app start, 0 = not reached yet)
+volatile int64_t bootGateReadyUs = 0;
+volatile int64_t bootWifiConnectedUs = 0;
+volatile int64_t bootFirstSensorReportUs = 0;
+bool bootReportPublished = false;
+
 // ==================== TASK MANAGEMENT ====================
 
+// Stack budgets (bytes). Tasks that end up in a TLS handshake (MQTT connect,
+// backend POST) need ~5 KB. No high-water marks have been recorded yet, so
+// these are the pre-static-allocation sizes; shrink one only after logging
+// its HWM with HEAP_INVARIANT_CHECK (size = peak usage + ~1 KB margin) and
+// note the measured peak next to it.
+const uint32_t TASK_WIFI_MQTT_STACK    = 8192;   // MQTT TLS handshake; HWM: not measured
+const uint32_t TASK_KEYPAD_STACK       = 6144;
+const uint32_t TASK_SENSORS_STACK      = 6144;
+const uint32_t TASK_SCHEDULER_STACK    = 6144;
+const uint32_t TASK_LOCAL_CONTROL_STACK = 4096;   // no TLS: gate commands are queued; HWM: not measured
+const uint32_t TASK_NET_WORKER_STACK   = 6144;   // backend POST (TLS); HWM: not measured
+
+// Statically allocated task stacks + TCBs
+StackType_t  taskWifiMqttStack[TASK_WIFI_MQTT_STACK];
+StackType_t  taskKeypadStack[TASK_KEYPAD_STACK];
+StackType_t  taskSensorsStack[TASK_SENSORS_STACK];
+StackType_t  taskSchedulerStack[TASK_SCHEDULER_STACK];
+StackType_t  taskLocalControlStack[TASK_LOCAL_CONTROL_STACK];
+StackType_t  taskNetWorkerStack[TASK_NET_WORKER_STACK];
+StaticTask_t taskWifiMqttTcb;
+StaticTask_t taskKeypadTcb;
+StaticTask_t taskSensorsTcb;
+StaticTask_t taskSchedulerTcb;
+StaticTask_t taskLocalControlTcb;
+StaticTask_t taskNetWorkerTcb;
+
 // Task handles
 TaskHandle_t taskWifiMqttHandle        = NULL;
 TaskHandle_t taskKeypadHandle         = NULL;
 TaskHandle_t taskSensorsHandle        = NULL;
-TaskHandle_t taskGateHandle           = NULL;
-TaskHandle_t taskPowerMemoryHandle    = NULL;
+TaskHandle_t taskSchedulerHandle      = NULL;
+TaskHandle_t taskLocalControlHandle   = NULL;
+TaskHandle_t taskNetWorkerHandle      = NULL;
+
+// Network/flash work handed off by timer callbacks (they must not block
+// TaskScheduler). Statically allocated FIFO, so servo "open" → "closed"
+// reports keep their order. Snapshot publish and persist only need to run
+// once more after the last change, so at most one of each is queued; the
+// rest of the queue is left to servo reports, which are never coalesced.
+enum NetJobType {
+  NET_JOB_SERVO_CALLBACK,
+  NET_JOB_STATE_PUBLISH,
+  NET_JOB_PERSIST,
+  NET_JOB_BENCHMARK,
+  NET_JOB_TYPE_COUNT
+};
+
+struct NetJob {
+  uint8_t type;
+  char state[12];
+  uint64_t eventMs;
+  char traceId[17];                          // trace at post time; may have ended by send time
+};
+
+const UBaseType_t NET_JOB_QUEUE_LENGTH = 16;
+const TickType_t NET_JOB_SERVO_WAIT = pdMS_TO_TICKS(100);   // short: the caller runs the gate FSM
+uint8_t netJobQueueStorage[NET_JOB_QUEUE_LENGTH * sizeof(NetJob)];
+StaticQueue_t netJobQueueBuffer;
+QueueHandle_t netJobQueue = NULL;
+bool netJobQueued[NET_JOB_TYPE_COUNT];       // coalesced types: one already waiting
+portMUX_TYPE netJobMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Local control plane sockets (-1 = not open)
+int localHttpSocket = -1;
+int localUdpSocket  = -1;
+
+// Serialises access to backendTransport (keypad, sensors and scheduler all POST)
+StaticSemaphore_t transportMutexBuffer;
+SemaphoreHandle_t transportMutex = NULL;
+
+// PubSubClient is not thread-safe: TaskWifiMqtt runs loop()/connect() while
+// keypad, sensors and the net worker publish. Recursive, because
+// mqttCallback runs inside loop() and the reconnect path publishes.
+StaticSemaphore_t mqttMutexBuffer;
+SemaphoreHandle_t mqttMutex = NULL;
+const TickType_t MQTT_LOCK_WAIT = pdMS_TO_TICKS(1000);
 
 // Memory management variables (no Serial print, hanya monitoring)
 volatile size_t currentFreeHeap = 0;
 volatile size_t minFreeHeap     = 0;
 
+// ==================== TIMER SCHEDULER ====================
+
+// One-shot (periodMs == 0) or periodic deadline timers, all run by
+// TaskScheduler. The task sleeps until the nearest deadline, so nothing polls.
+typedef void (*TimerCallback)(int arg);
+
+enum TimerId {
+  TIMER_GATE_AUTO_CLOSE,
+  TIMER_GATE_COMMAND,
+  TIMER_GATE_MOTION,
+  TIMER_GATE_BEAM,
+  TIMER_MQTT_RECONNECT,
+  TIMER_METRICS_FLUSH,
+  TIMER_STATE_PUBLISH,
+  TIMER_STATE_REFRESH,
+  TIMER_PERSIST,
+  TIMER_PERSIST_HEARTBEAT,
+  TIMER_NVS_RESTORE,
+  TIMER_BENCHMARK,
+  TIMER_SENSOR_DEBOUNCE,                            // + slot index (0..3)
+  TIMER_COUNT = TIMER_SENSOR_DEBOUNCE + 4
+};
+
+struct SchedTimer {
+  TimerCallback callback;
+  int arg;
+  unsigned long deadline;
+  unsigned long periodMs;
+  bool armed;
+};
+
+SchedTimer timers[TIMER_COUNT];
+portMUX_TYPE timerMux = portMUX_INITIALIZER_UNLOCKED;
+
+// ==================== GATE ====================
+
+// Every transition runs on TaskScheduler (commands, beam edges and motion
+// segments all arrive as timers), so the FSM state needs no lock.
+enum GateState {
+  GATE_CLOSED,
+  GATE_OPENING,
+  GATE_OPEN,
+  GATE_CLOSING,
+  GATE_BLOCKED            // held open: beam obstructed, closes once it clears
+};
+
+enum GateCommand {
+  GATE_CMD_OPEN,
+  GATE_CMD_CLOSE
+};
+
+const char* const GATE_STATE_NAMES[] = {"closed", "opening", "open", "closing", "blocked"};
+
+volatile GateState gateState = GATE_CLOSED;
+volatile bool gateBeamObstructed = false;    // written by onGateBeamEdge (ISR)
+
+// Motion profile: travel fraction reached at the end of each of 8 equal time
+// slices. Trapezoidal velocity (accelerate 1/4, cruise 1/2, decelerate 1/4
+// of the move); each slice is one linear LEDC fade, run by the hardware.
+const int GATE_PROFILE_SEGMENTS = 8;
+const float GATE_PROFILE[GATE_PROFILE_SEGMENTS + 1] = {
+  0.0f, 1.0f / 24, 1.0f / 6, 2.0f / 6, 3.0f / 6, 4.0f / 6, 5.0f / 6, 23.0f / 24, 1.0f
+};
+
+float gatePosition = 0.0f;       // 0 = closed, 1 = open (as of the last segment end)
+float gateTarget = 0.0f;         // where the FSM wants the gate
+float gateMotionFrom = 0.0f;     // current move
+float gateMotionTo = 0.0f;
+int gateMotionSegment = 0;
+unsigned long gateSegmentMs = 0;
+
+// Gate metrics: a cycle runs from the open command (gate CLOSED) to CLOSED again
+const int GATE_RATE_BUCKETS = 12;                     // 12 x 5 min = last hour
+const unsigned long GATE_RATE_BUCKET_MS = 300000;
+unsigned long gateCycleStartedAt = 0;
+uint32_t gateCycles = 0;
+uint32_t gateReversals = 0;
+unsigned long gateLastCycleMs = 0;
+unsigned long gateAvgCycleMs = 0;                      // EWMA, 1/8 weight
+uint32_t gateRateSlice[GATE_RATE_BUCKETS];
+uint16_t gateRateCount[GATE_RATE_BUCKETS];
+
+// ==================== BACKEND TRANSPORT ====================
+
+// How validateVoucher / sendSensorUpdate / sendServoCallback reach the
+// backend. `reliable` = command that needs an answer; false = telemetry that
+// may be fire-and-forget. Returns an HTTP-style status (2xx → 200 for CoAP,
+// TRANSPORT_SENT_NO_REPLY for fire-and-forget) or a negative HTTPC_ERROR_*.
+class BackendTransport {
+public:
+  virtual ~BackendTransport() {}
+  virtual const char* name() const = 0;
+  virtual int post(const char* path, const char* body, bool reliable, char* response, size_t responseSize) = 0;
+  virtual size_t bytesSent() const = 0;
+  virtual size_t bytesReceived() const = 0;
+};
+
+const int TRANSPORT_SENT_NO_REPLY = 202;
+
+// Socket-level byte counters for the benchmark (TLS payload, not records)
+template <class Base>
+class CountingClient : public Base {
+public:
+  size_t sent = 0;
+  size_t received = 0;
+  size_t write(const uint8_t* buffer, size_t size) override {
+    size_t n = Base::write(buffer, size);
+    sent += n;
+    return n;
+  }
+  int read() override {
+    int c = Base::read();
+    if (c >= 0) {
+      received++;
+    }
+    return c;
+  }
+  int read(uint8_t* buffer, size_t size) override {
+    int n = Base::read(buffer, size);
+    if (n > 0) {
+      received += n;
+    }
+    return n;
+  }
+};
+
+// HTTP(S) POST with a long-lived keep-alive client (no per-request alloc)
+template <class ClientType>
+class HttpTransport : public BackendTransport {
+public:
+  HttpTransport(CountingClient<ClientType>& client, const char* baseUrl) : client(client), baseUrl(baseUrl) {}
+  const char* name() const override { return "http"; }
+  int post(const char* path, const char* body, bool reliable, char* response, size_t responseSize) override;
+  size_t bytesSent() const override { return client.sent; }
+  size_t bytesReceived() const override { return client.received; }
+private:
+  CountingClient<ClientType>& client;
+  const char* baseUrl;
+  HTTPClient http;
+};
+
+// CoAP (RFC 7252) POST over UDP, optionally inside a DTLS 1.2 PSK session.
+// CON requests are retransmitted with exponential backoff until ACKed.
+class CoapTransport : public BackendTransport {
+public:
+  CoapTransport(const char* host, uint16_t port, bool useDtls) : host(host), port(port), useDtls(useDtls) {}
+  const char* name() const override { return useDtls ? "coaps" : "coap"; }
+  int post(const char* path, const char* body, bool reliable, char* response, size_t responseSize) override;
+  size_t bytesSent() const override { return sent; }
+  size_t bytesReceived() const override { return received; }
+private:
+  bool ensureSession();
+  void closeSession();
+  int sendDatagram(const uint8_t* data, size_t length);
+  int receiveDatagram(uint8_t* data, size_t size, uint32_t timeoutMs);
+  size_t buildRequest(uint8_t* out, size_t size, bool confirmable, uint16_t messageId, const uint8_t* token,
+                      const char* path, const char* body);
+  static int rawSend(int sock, const uint8_t* data, size_t length);
+  static int rawReceive(int sock, uint8_t* data, size_t size, uint32_t timeoutMs);
+#if COAP_DTLS_ENABLED
+  static int dtlsSend(void* ctx, const unsigned char* data, size_t length);
+  static int dtlsReceive(void* ctx, unsigned char* data, size_t size, uint32_t timeoutMs);
+  static void dtlsSetDelay(void* ctx, uint32_t intermediateMs, uint32_t finalMs);
+  static int dtlsGetDelay(void* ctx);
+  bool dtlsConfigured = false;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config conf;
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context drbg;
+  unsigned long timerStartMs = 0;
+  uint32_t timerIntermediateMs = 0;
+  uint32_t timerFinalMs = 0;
+#endif
+  const char* host;
+  uint16_t port;
+  bool useDtls;
+  int sock = -1;
+  uint16_t nextMessageId = 0;
+  size_t sent = 0;
+  size_t received = 0;
+};
+
+#if BACKEND_TRANSPORT_COAP
+CoapTransport coapTransport(COAP_HOST, COAP_PORT, COAP_DTLS_ENABLED);
+BackendTransport* backendTransport = &coapTransport;
+#else
+// One long-lived TLS client for backend requests (keep-alive, no per-request alloc)
+CountingClient<WiFiClientSecure> httpsClient;
+HttpTransport<WiFiClientSecure> httpTransport(httpsClient, BACKEND_API_BASE);
+BackendTransport* backendTransport = &httpTransport;
+#endif
+
+#if TRANSPORT_BENCHMARK
+CountingClient<WiFiClient> benchHttpClient;
+HttpTransport<WiFiClient> benchHttpTransport(benchHttpClient, BENCH_HTTP_BASE);
+CoapTransport benchCoapTransport(BENCH_HOST, BENCH_COAP_PORT, false);
+// Own MQTT client to the stand-in's broker, used only by TaskNetWorker (the
+// shared mqttClient belongs to TaskWifiMqtt and PubSubClient is not thread-safe)
+CountingClient<WiFiClient> benchMqttNet;
+PubSubClient benchMqttClient(benchMqttNet);
+volatile bool benchMqttEchoReceived = false;
+#endif
+
+// MQTT reconnect backoff (driven by TIMER_MQTT_RECONNECT)
+volatile bool mqttReconnectDue = true;
+unsigned long mqttReconnectBackoff = MQTT_RECONNECT_INTERVAL;
+
+#if HEAP_INVARIANT_CHECK
+#if HEAP_TRACE_AVAILABLE
+heap_trace_record_t heapTraceRecords[HEAP_TRACE_RECORDS];
+bool heapTraceReady = false;
+#endif
+size_t heapBaseline = 0;
+unsigned long mqttFirstConnectedAt = 0;
+#endif
+
 // Forward declaration task functions
 void TaskWifiMqtt(void *pvParameters);
 void TaskKeypad(void *pvParameters);
 void TaskSensors(void *pvParameters);
-void TaskGate(void *pvParameters);
-void TaskPowerMemory(void *pvParameters);
+void TaskScheduler(void *pvParameters);
+void TaskLocalControl(void *pvParameters);
+void TaskNetWorker(void *pvParameters);
 
 // Forward declaration existing functions (supaya jelas untuk compiler)
 void connectWiFi();
 void reconnectMQTT();
+bool mqttLock(TickType_t wait = MQTT_LOCK_WAIT);
+void mqttUnlock();
+bool mqttIsConnected(TickType_t wait = MQTT_LOCK_WAIT);
+bool mqttPublish(const char* topic, const char* payload, bool retained = false);
 void mqttCallback(char* topic, byte* payload, unsigned int length);
 void handleKeypadInput();
 void checkAllSensors();
-void handleAutoCloseGate();
-void validateVoucher(String code);
+void timerStart(int id, TimerCallback callback, int arg, unsigned long delayMs, unsigned long periodMs);
+void timerCancel(int id);
+bool timerArmed(int id);
+void onGateAutoCloseTimer(int arg);
+void onGateCommandTimer(int command);
+void onGateMotionTimer(int arg);
+void onGateBeamTimer(int obstructed);
+void onMqttReconnectTimer(int arg);
+void onMetricsFlushTimer(int arg);
+void onStatePublishTimer(int arg);
+void onPersistTimer(int arg);
+void onNvsRestoreTimer(int arg);
+void onSensorDebounceTimer(int index);
+void validateVoucher(const char* code);
 void checkSensor(int index);
-void sendSensorUpdate(int slotNumber, String status);
+bool sendSensorUpdate(int slotNumber, const char* status, uint64_t eventMs);
+void resendPendingSlotReports();
 void openGate();
 void closeGate();
-void sendServoCallback(String state);
-void logLedEvent(String state, int slotNumber, String reason);
-void logBuzzerEvent(String state, int slotNumber, String reason);
+bool gateIsClosed();
+void gateRequestClose();
+void IRAM_ATTR onGateBeamEdge();
+void setGateState(GateState newState);
+void initGateServo(float startPosition);
+uint32_t gateDutyFor(float fraction);
+void gateMoveTo(float target);
+void gatePlanMotion();
+void gateMotionStep();
+void onGateMotionDone();
+void recordGateCycle();
+unsigned long gateVehiclesLastHour();
+unsigned long gateCapacityPerHour();
+void sendServoCallback(const char* state, uint64_t eventMs, const char* traceId);
+int postBackend(const char* path, const char* body, bool reliable, char* response, size_t responseSize);
+void runTransportBenchmark();
+void onBenchmarkTimer(int arg);
+bool postNetJob(NetJobType type, const char* state, uint64_t eventMs);
+void logLedEvent(const char* state, int slotNumber, const char* reason);
+void logBuzzerEvent(const char* state, int slotNumber, const char* reason);
+void checkHeapInvariant();
+void handleLocalRequest(int clientSocket);
+void buildStateSnapshot(JsonDocument& doc);
+void markStateChanged();
+void publishStateSnapshot();
+uint32_t persistCrc(const PersistedState& state);
+bool persistValid(const PersistedState& state);
+void captureState(PersistedState& state);
+void persistState();
+void writePersistedState();
+bool restoreState();
+void applyRestoredState(const PersistedState& state);
+const char* resetReasonName(esp_reset_reason_t reason);
+void markSensorReported();
+void publishBootReport();
+void localBroadcast(const char* json);
+void announceSlotLocal(int slotNumber, const char* status, uint64_t eventMs);
+void announceGateLocal(const char* state, uint64_t eventMs);
+uint64_t wallClockMs();
+void stampMessage(JsonDocument& doc, int channel, uint64_t eventMs, const char* traceIdAtEvent = NULL);
+void beginTrace();
+void endTraceIfIdle();
+void printLogTimestamp();
 void blinkSuccess();
 void blinkError();
 
@@ -195,37 +766,60 @@ void setup() {
   // Turunkan frekuensi CPU untuk power management (tidak mengubah algoritma)
   setCpuFrequencyMhz(80);
 
+  // Warm restart: bring back reservation / LED / buzzer / gate before any output
+  Serial.print("Reset reason: ");
+  Serial.println(resetReasonName(esp_reset_reason()));
+  bool gateWasOpen = restoreState();
+
   // Initialize IR Sensors
   for (int i = 0; i < 4; i++) {
     pinMode(irSensorPins[i], INPUT_PULLUP);
   }
   Serial.println("✓ IR Sensors initialized");
   
-  // Initialize Gate Servo
-  gateServo.attach(gateServoPin);
-  gateServo.write(SERVO_CLOSED);
+  // Initialize Gate Servo (LEDC) + beam sensor. A gate that was up when we
+  // went down is held open (never dropped on whatever is under it) and
+  // closes through the FSM as usual.
+  pinMode(gateBeamPin, INPUT_PULLUP);
+  gateBeamObstructed = !digitalRead(gateBeamPin);
+  attachInterrupt(digitalPinToInterrupt(gateBeamPin), onGateBeamEdge, CHANGE);
+  initGateServo(gateWasOpen ? 1.0f : 0.0f);
+  if (gateWasOpen) {
+    gateState = gateBeamObstructed ? GATE_BLOCKED : GATE_OPEN;
+    if (gateState == GATE_OPEN) {
+      timerStart(TIMER_GATE_AUTO_CLOSE, onGateAutoCloseTimer, 0, SERVO_AUTO_CLOSE_DELAY, 0);
+    }
+  }
   Serial.println("✓ Gate servo initialized");
 
   pinMode(indicatorLedPin, OUTPUT);
-  digitalWrite(indicatorLedPin, LOW);
-  indicatorLedOn = false;
+  digitalWrite(indicatorLedPin, indicatorLedOn ? HIGH : LOW);
   
   // Initialize Buzzer
   pinMode(buzzerPin, OUTPUT);
-  digitalWrite(buzzerPin, LOW);
-  buzzerActive = false;
+  digitalWrite(buzzerPin, buzzerActive ? HIGH : LOW);
   Serial.println("✓ Buzzer initialized");
   
-  // Connect to WiFi
-  connectWiFi();
+  // WiFi is brought up by TaskWifiMqtt, in parallel with sensing below
   
   // Setup MQTT
   wifiClient.setInsecure();
+#if !BACKEND_TRANSPORT_COAP
+  httpsClient.setInsecure();
+#endif
+  transportMutex = xSemaphoreCreateMutexStatic(&transportMutexBuffer);
+  mqttMutex = xSemaphoreCreateRecursiveMutexStatic(&mqttMutexBuffer);
+  netJobQueue = xQueueCreateStatic(NET_JOB_QUEUE_LENGTH, sizeof(NetJob), netJobQueueStorage, &netJobQueueBuffer);
   mqttClient.setServer(MQTT_BROKER, MQTT_PORT);
   mqttClient.setCallback(mqttCallback);
+  mqttClient.setBufferSize(768);           // state snapshot + trace fields exceed the 256 B default
   
-  // Initial sensor readings
+  // Initial sensor readings (valid immediately; WiFi is not up yet, so each
+  // changed slot is re-sent by TaskSensors once it is, and the MQTT connect
+  // publishes the full snapshot)
+  sensorBootPass = true;
   checkAllSensors();
+  sensorBootPass = false;
   
   Serial.println("=== System Ready ===\n");
 
@@ -233,29 +827,52 @@ void setup() {
   currentFreeHeap = ESP.getFreeHeap();
   minFreeHeap     = currentFreeHeap;
 
+#if HEAP_TRACE_AVAILABLE
+  esp_err_t traceErr = heap_trace_init_standalone(heapTraceRecords, HEAP_TRACE_RECORDS);
+  heapTraceReady = traceErr == ESP_OK;
+  if (!heapTraceReady) {
+    Serial.printf("[MEM] ✗ heap_trace_init_standalone failed: %d\n", (int) traceErr);
+  }
+#elif HEAP_INVARIANT_CHECK
+  Serial.println("[MEM] Heap tracing unavailable (CONFIG_HEAP_TRACING_STANDALONE not set)");
+#endif
+
   // ==================== CREATE RTOS TASKS ====================
   // Task WiFi + MQTT (Core 0)
-xTaskCreatePinnedToCore(TaskWifiMqtt, "TaskWifiMqtt", 8192, NULL, 3, &taskWifiMqttHandle, 0);
+  taskWifiMqttHandle = xTaskCreateStaticPinnedToCore(TaskWifiMqtt, "TaskWifiMqtt", TASK_WIFI_MQTT_STACK, NULL, 3, taskWifiMqttStack, &taskWifiMqttTcb, 0);
+
+  // Task Keypad (Core 1)
+  taskKeypadHandle = xTaskCreateStaticPinnedToCore(TaskKeypad, "TaskKeypad", TASK_KEYPAD_STACK, NULL, 2, taskKeypadStack, &taskKeypadTcb, 1);
 
-// Task Keypad (Core 1)
-xTaskCreatePinnedToCore(TaskKeypad, "TaskKeypad", 6144, NULL, 2, &taskKeypadHandle, 1);
+  // Task Sensors (Core 1)
+  taskSensorsHandle = xTaskCreateStaticPinnedToCore(TaskSensors, "TaskSensors", TASK_SENSORS_STACK, NULL, 2, taskSensorsStack, &taskSensorsTcb, 1);
 
-// Task Sensors (Core 1)
-xTaskCreatePinnedToCore(TaskSensors, "TaskSensors", 6144, NULL, 2, &taskSensorsHandle, 1);
+  // Task Scheduler: gate FSM, metrics, debounce (Core 1)
+  taskSchedulerHandle = xTaskCreateStaticPinnedToCore(TaskScheduler, "TaskScheduler", TASK_SCHEDULER_STACK, NULL, 2, taskSchedulerStack, &taskSchedulerTcb, 1);
 
-// Task Gate (Core 1)
-xTaskCreatePinnedToCore(TaskGate, "TaskGate", 4096, NULL, 1, &taskGateHandle, 1);
+  // Task Net Worker: backend/MQTT/NVS work queued by timer callbacks (Core 0)
+  taskNetWorkerHandle = xTaskCreateStaticPinnedToCore(TaskNetWorker, "TaskNetWorker", TASK_NET_WORKER_STACK, NULL, 1, taskNetWorkerStack, &taskNetWorkerTcb, 0);
 
-// Task Power + Memory (Core 0)
-xTaskCreatePinnedToCore(TaskPowerMemory, "TaskPowerMemory", 4096, NULL, 1, &taskPowerMemoryHandle, 0);
+  timerStart(TIMER_METRICS_FLUSH, onMetricsFlushTimer, 0, METRICS_FLUSH_INTERVAL, METRICS_FLUSH_INTERVAL);
+  timerStart(TIMER_STATE_REFRESH, onStatePublishTimer, 0, STATE_REFRESH_INTERVAL, STATE_REFRESH_INTERVAL);
+  timerStart(TIMER_PERSIST_HEARTBEAT, onPersistTimer, 0, PERSIST_NVS_HEARTBEAT, PERSIST_NVS_HEARTBEAT);
 
+#if TRANSPORT_BENCHMARK
+  // Give WiFi + MQTT time to come up; the run itself happens on TaskNetWorker
+  timerStart(TIMER_BENCHMARK, onBenchmarkTimer, 0, 15000, 0);
+#endif
+
+#if LOCAL_CONTROL_ENABLED
+  // Task Local Control: LAN HTTP endpoint (Core 0)
+  taskLocalControlHandle = xTaskCreateStaticPinnedToCore(TaskLocalControl, "TaskLocalControl", TASK_LOCAL_CONTROL_STACK, NULL, 2, taskLocalControlStack, &taskLocalControlTcb, 0);
+#endif
 }
 
 // ==================== MAIN LOOP ====================
-// Algoritma utama sekarang dijalankan di RTOS Tasks.
-// Loop hanya idle supaya kompatibel dengan Arduino.
+// Algoritma utama sekarang dijalankan di RTOS Tasks + TaskScheduler.
+// Loop task tidak dipakai, jadi dihapus (tidak ada wake-up kosong tiap detik).
 void loop() {
-  vTaskDelay(1000 / portTICK_PERIOD_MS);
+  vTaskDelete(NULL);
 }
 
 // ==================== RTOS TASK IMPLEMENTATIONS ====================
@@ -268,13 +885,23 @@ void TaskWifiMqtt(void *pvParameters) {
       connectWiFi();
     }
 
-    if (!mqttClient.connected()) {
-      if (millis() - lastMqttReconnect > MQTT_RECONNECT_INTERVAL) {
+    if (mqttLock()) {
+      if (mqttClient.connected()) {
+        mqttClient.loop();
+        mqttReconnectBackoff = MQTT_RECONNECT_INTERVAL;
+      } else if (mqttReconnectDue) {
+        mqttReconnectDue = false;
         reconnectMQTT();
-        lastMqttReconnect = millis();
+        if (!mqttClient.connected()) {
+          // Exponential backoff: 5 s, 10 s, 20 s ... capped at 60 s
+          timerStart(TIMER_MQTT_RECONNECT, onMqttReconnectTimer, 0, mqttReconnectBackoff, 0);
+          mqttReconnectBackoff = min(mqttReconnectBackoff * 2, MQTT_RECONNECT_MAX_INTERVAL);
+        }
+      } else if (!timerArmed(TIMER_MQTT_RECONNECT)) {
+        // Connection dropped since the last pass
+        timerStart(TIMER_MQTT_RECONNECT, onMqttReconnectTimer, 0, mqttReconnectBackoff, 0);
       }
-    } else {
-      mqttClient.loop();
+      mqttUnlock();
     }
 
     vTaskDelay(10 / portTICK_PERIOD_MS); // sering, supaya MQTT responsif
@@ -295,36 +922,273 @@ void TaskSensors(void *pvParameters) {
   for (;;) {
     // Tadinya di loop(): checkAllSensors
     checkAllSensors();
+    resendPendingSlotReports();
     vTaskDelay(50 / portTICK_PERIOD_MS);
   }
 }
 
-void TaskGate(void *pvParameters) {
+void TaskScheduler(void *pvParameters) {
   (void) pvParameters;
+  // The gate FSM runs here: from now on gate commands are served
+  bootGateReadyUs = esp_timer_get_time();
   for (;;) {
-    // Tadinya di loop(): handleAutoCloseGate
-    handleAutoCloseGate();
-    vTaskDelay(50 / portTICK_PERIOD_MS);
+    // Fire every due timer; callbacks run outside the critical section so
+    // they may re-arm timers. They must not block: network/flash work goes
+    // to TaskNetWorker via postNetJob().
+    for (int i = 0; i < TIMER_COUNT; i++) {
+      TimerCallback callback = NULL;
+      int arg = 0;
+      unsigned long now = millis();
+
+      portENTER_CRITICAL(&timerMux);
+      SchedTimer &timer = timers[i];
+      if (timer.armed && (long) (timer.deadline - now) <= 0) {
+        callback = timer.callback;
+        arg = timer.arg;
+        if (timer.periodMs > 0) {
+          timer.deadline += timer.periodMs;
+          if ((long) (timer.deadline - now) <= 0) {
+            timer.deadline = now + timer.periodMs; // overran, don't burst
+          }
+        } else {
+          timer.armed = false;
+        }
+      }
+      portEXIT_CRITICAL(&timerMux);
+
+      if (callback) {
+        callback(arg);
+      }
+    }
+
+    // Sleep until the nearest deadline, or until timerStart() notifies us
+    TickType_t wait = portMAX_DELAY;
+    unsigned long now = millis();
+    portENTER_CRITICAL(&timerMux);
+    for (int i = 0; i < TIMER_COUNT; i++) {
+      if (!timers[i].armed) {
+        continue;
+      }
+      long remaining = (long) (timers[i].deadline - now);
+      TickType_t ticks = remaining > 0 ? pdMS_TO_TICKS(remaining) : 0;
+      if (ticks < wait) {
+        wait = ticks;
+      }
+    }
+    portEXIT_CRITICAL(&timerMux);
+
+    if (wait > 0) {
+      ulTaskNotifyTake(pdTRUE, wait);
+    }
+  }
+}
+
+void TaskNetWorker(void *pvParameters) {
+  (void) pvParameters;
+  NetJob job;
+  for (;;) {
+    if (xQueueReceive(netJobQueue, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    // Cleared before running, so a change made meanwhile queues a fresh run
+    portENTER_CRITICAL(&netJobMux);
+    netJobQueued[job.type] = false;
+    portEXIT_CRITICAL(&netJobMux);
+    switch (job.type) {
+      case NET_JOB_SERVO_CALLBACK:
+        sendServoCallback(job.state, job.eventMs, job.traceId);
+        break;
+      case NET_JOB_STATE_PUBLISH:
+        publishStateSnapshot();
+        break;
+      case NET_JOB_PERSIST:
+        writePersistedState();
+        break;
+      case NET_JOB_BENCHMARK:
+        runTransportBenchmark();
+        break;
+    }
   }
 }
 
-void TaskPowerMemory(void *pvParameters) {
+void TaskLocalControl(void *pvParameters) {
   (void) pvParameters;
+
+  // lwIP needs the station interface up before sockets can bind
+  while (WiFi.status() != WL_CONNECTED) {
+    vTaskDelay(500 / portTICK_PERIOD_MS);
+  }
+
+  localUdpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+  int broadcastEnable = 1;
+  setsockopt(localUdpSocket, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable));
+
+  localHttpSocket = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(LOCAL_HTTP_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(localHttpSocket, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(localHttpSocket, 2) != 0) {
+    Serial.println("✗ Local control plane failed to start");
+    close(localHttpSocket);
+    localHttpSocket = -1;
+    vTaskDelete(NULL);
+    return;
+  }
+  Serial.print("✓ Local control plane on port ");
+  Serial.println(LOCAL_HTTP_PORT);
+
   for (;;) {
-    // Memory management: pantau heap (tanpa mengubah Serial output)
-    currentFreeHeap = ESP.getFreeHeap();
-    if (currentFreeHeap < minFreeHeap) {
-      minFreeHeap = currentFreeHeap;
+    // accept() blocks, so the task costs nothing while no client is around
+    int clientSocket = accept(localHttpSocket, NULL, NULL);
+    if (clientSocket < 0) {
+      vTaskDelay(100 / portTICK_PERIOD_MS);
+      continue;
     }
+    handleLocalRequest(clientSocket);
+  }
+}
 
-    // Power management tambahan bisa ditaruh di sini (tanpa Serial):
-    // misalnya: logika kalau idle lama -> bisa matikan beberapa peripheral, dsb.
-    // Di sini kita biarkan ringan saja, cukup modem sleep dan CPU freq di-setup.
+// ==================== TIMERS ====================
 
-    vTaskDelay(5000 / portTICK_PERIOD_MS); // cek tiap 5 detik
+void timerStart(int id, TimerCallback callback, int arg, unsigned long delayMs, unsigned long periodMs) {
+  portENTER_CRITICAL(&timerMux);
+  timers[id].callback = callback;
+  timers[id].arg = arg;
+  timers[id].deadline = millis() + delayMs;
+  timers[id].periodMs = periodMs;
+  timers[id].armed = true;
+  portEXIT_CRITICAL(&timerMux);
+
+  if (taskSchedulerHandle != NULL) {
+    xTaskNotifyGive(taskSchedulerHandle);
   }
 }
 
+void timerCancel(int id) {
+  portENTER_CRITICAL(&timerMux);
+  timers[id].armed = false;
+  portEXIT_CRITICAL(&timerMux);
+}
+
+bool timerArmed(int id) {
+  portENTER_CRITICAL(&timerMux);
+  bool armed = timers[id].armed;
+  portEXIT_CRITICAL(&timerMux);
+  return armed;
+}
+
+// Snapshot publish / persist are coalesced (never block, never need to).
+// Servo reports wait briefly for room: the backend's gate session only ends
+// on the "closed" report, so losing one locks out later vouchers.
+bool postNetJob(NetJobType type, const char* state, uint64_t eventMs) {
+  bool coalesced = type == NET_JOB_STATE_PUBLISH || type == NET_JOB_PERSIST;
+  if (coalesced) {
+    portENTER_CRITICAL(&netJobMux);
+    bool alreadyQueued = netJobQueued[type];
+    netJobQueued[type] = true;
+    portEXIT_CRITICAL(&netJobMux);
+    if (alreadyQueued) {
+      return true;
+    }
+  }
+
+  NetJob job = {};
+  job.type = type;
+  if (state != NULL) {
+    strncpy(job.state, state, sizeof(job.state) - 1);
+  }
+  job.eventMs = eventMs;
+  portENTER_CRITICAL(&traceMux);
+  memcpy(job.traceId, currentTraceId, sizeof(job.traceId));
+  portEXIT_CRITICAL(&traceMux);
+  TickType_t wait = type == NET_JOB_SERVO_CALLBACK ? NET_JOB_SERVO_WAIT : 0;
+  if (netJobQueue == NULL || xQueueSend(netJobQueue, &job, wait) != pdTRUE) {
+    if (coalesced) {
+      portENTER_CRITICAL(&netJobMux);
+      netJobQueued[type] = false;
+      portEXIT_CRITICAL(&netJobMux);
+    }
+    Serial.print("✗ Net job queue full, dropped job ");
+    Serial.println((int) type);
+    return false;
+  }
+  return true;
+}
+
+void onMqttReconnectTimer(int arg) {
+  (void) arg;
+  mqttReconnectDue = true;
+}
+
+void onSensorDebounceTimer(int index) {
+  sensorDebouncing[index] = false;
+}
+
+void onMetricsFlushTimer(int arg) {
+  (void) arg;
+  // Memory management: pantau heap (tanpa mengubah Serial output)
+  currentFreeHeap = ESP.getFreeHeap();
+  if (currentFreeHeap < minFreeHeap) {
+    minFreeHeap = currentFreeHeap;
+  }
+
+  // Power management tambahan bisa ditaruh di sini (tanpa Serial):
+  // misalnya: logika kalau idle lama -> bisa matikan beberapa peripheral, dsb.
+  // Di sini kita biarkan ringan saja, cukup modem sleep dan CPU freq di-setup.
+
+  checkHeapInvariant();
+}
+
+// Diagnostic mode only: once the connection stack has warmed up, free heap
+// must stay flat. Drift beyond tolerance dumps the heap trace and asserts.
+void checkHeapInvariant() {
+#if HEAP_INVARIANT_CHECK
+  Serial.printf("[MEM] free=%u min=%u largest=%u | stack HWM wifi=%u keypad=%u sensors=%u scheduler=%u worker=%u local=%u\n",
+                (unsigned) currentFreeHeap, (unsigned) minFreeHeap, (unsigned) ESP.getMaxAllocHeap(),
+                (unsigned) uxTaskGetStackHighWaterMark(taskWifiMqttHandle),
+                (unsigned) uxTaskGetStackHighWaterMark(taskKeypadHandle),
+                (unsigned) uxTaskGetStackHighWaterMark(taskSensorsHandle),
+                (unsigned) uxTaskGetStackHighWaterMark(taskSchedulerHandle),
+                (unsigned) uxTaskGetStackHighWaterMark(taskNetWorkerHandle),
+                taskLocalControlHandle ? (unsigned) uxTaskGetStackHighWaterMark(taskLocalControlHandle) : 0u);
+
+  if (mqttFirstConnectedAt == 0) {
+    if (mqttIsConnected(0)) {   // TaskScheduler: don't wait out a reconnect
+      mqttFirstConnectedAt = millis();
+    }
+    return;
+  }
+
+  if (heapBaseline == 0) {
+    if (millis() - mqttFirstConnectedAt >= HEAP_INVARIANT_WARMUP_MS) {
+      heapBaseline = currentFreeHeap;
+#if HEAP_TRACE_AVAILABLE
+      if (heapTraceReady && heap_trace_start(HEAP_TRACE_LEAKS) != ESP_OK) {
+        Serial.println("[MEM] ✗ heap_trace_start failed, continuing without trace");
+        heapTraceReady = false;
+      }
+#endif
+      Serial.printf("[MEM] Heap baseline captured: %u bytes\n", (unsigned) heapBaseline);
+    }
+    return;
+  }
+
+  if (currentFreeHeap + HEAP_INVARIANT_TOLERANCE < heapBaseline) {
+    Serial.printf("[MEM] ✗ Heap invariant violated: baseline=%u now=%u (delta=%d)\n",
+                  (unsigned) heapBaseline, (unsigned) currentFreeHeap,
+                  (int) heapBaseline - (int) currentFreeHeap);
+#if HEAP_TRACE_AVAILABLE
+    if (heapTraceReady) {
+      heap_trace_stop();
+      heap_trace_dump();
+    }
+#endif
+    configASSERT(false);
+  }
+#endif
+}
+
 // ==================== WIFI CONNECTION ====================
 
 void connectWiFi() {
@@ -344,11 +1208,17 @@ void connectWiFi() {
   
   if (WiFi.status() == WL_CONNECTED) {
     Serial.println("\n✓ WiFi connected");
+    if (bootWifiConnectedUs == 0) {
+      bootWifiConnectedUs = esp_timer_get_time();
+    }
     Serial.print("IP Address: ");
     Serial.println(WiFi.localIP());
 
     // Power management: aktifkan WiFi modem-sleep
     WiFi.setSleep(true);
+
+    // SNTP runs in the background; wallClockMs() returns 0 until it syncs
+    configTime(NTP_GMT_OFFSET_SEC, 0, NTP_SERVER_1, NTP_SERVER_2);
   } else {
     Serial.println("\n✗ WiFi connection failed!");
   }
@@ -356,6 +1226,37 @@ void connectWiFi() {
 
 // ==================== MQTT CONNECTION ====================
 
+bool mqttLock(TickType_t wait) {
+  return mqttMutex != NULL && xSemaphoreTakeRecursive(mqttMutex, wait) == pdTRUE;
+}
+
+void mqttUnlock() {
+  xSemaphoreGiveRecursive(mqttMutex);
+}
+
+bool mqttIsConnected(TickType_t wait) {
+  if (!mqttLock(wait)) {
+    return false;
+  }
+  bool connected = mqttClient.connected();
+  mqttUnlock();
+  return connected;
+}
+
+// Publish from any task. False if not connected or the client stayed busy
+// (reconnecting) for MQTT_LOCK_WAIT.
+bool mqttPublish(const char* topic, const char* payload, bool retained) {
+  if (!mqttLock()) {
+    Serial.print("✗ MQTT client busy, not published: ");
+    Serial.println(topic);
+    return false;
+  }
+  bool published = mqttClient.connected() && mqttClient.publish(topic, payload, retained);
+  mqttUnlock();
+  return published;
+}
+
+// Called by TaskWifiMqtt with mqttMutex held
 void reconnectMQTT() {
   if (!WiFi.isConnected()) {
     Serial.println("WiFi not connected, skipping MQTT reconnect");
@@ -374,6 +1275,10 @@ void reconnectMQTT() {
     Serial.println("✓ Subscribed to: parking/gate/open");
     Serial.println("✓ Subscribed to: parking/gate/close");
     Serial.println("✓ Subscribed to: parking/indicator/wrong-slot");
+
+    // Re-announce everything so consumers don't wait for the next change
+    publishStateSnapshot();
+    publishBootReport();
   } else {
     Serial.print("✗ MQTT connection failed, rc=");
     Serial.println(mqttClient.state());
@@ -383,41 +1288,37 @@ void reconnectMQTT() {
 // ==================== MQTT CALLBACK ====================
 
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  String message = "";
-  for (unsigned int i = 0; i < length; i++) {
-    message += (char)payload[i];
-  }
-  
   Serial.print("MQTT message received on topic: ");
   Serial.println(topic);
   Serial.print("Payload: ");
-  Serial.println(message);
+  Serial.write(payload, length);
+  Serial.println();
   
-  String topicStr = String(topic);
-  bool isOpenTopic = topicStr == "parking/gate/open";
-  bool isCloseTopic = topicStr == "parking/gate/close";
-  bool isIndicatorTopic = topicStr == "parking/indicator/wrong-slot";
+  bool isOpenTopic = strcmp(topic, "parking/gate/open") == 0;
+  bool isCloseTopic = strcmp(topic, "parking/gate/close") == 0;
+  bool isIndicatorTopic = strcmp(topic, "parking/indicator/wrong-slot") == 0;
 
   if (isIndicatorTopic) {
     StaticJsonDocument<200> doc;
-    DeserializationError error = deserializeJson(doc, message);
+    DeserializationError error = deserializeJson(doc, payload, length);
     if (error) {
       Serial.print("✗ Failed to parse indicator JSON: ");
       Serial.println(error.c_str());
       return;
     }
-    String state = doc["state"] | "off";
-    bool turnOn = state == "on" || doc["on"] == true;
+    const char* state = doc["state"] | "off";
+    bool turnOn = strcmp(state, "on") == 0 || doc["on"] == true;
     digitalWrite(indicatorLedPin, turnOn ? HIGH : LOW);
     indicatorLedOn = turnOn;
     Serial.print("Indicator LED ");
     Serial.println(turnOn ? "ON" : "OFF");
+    markStateChanged();
     return;
   }
 
   if (isOpenTopic || isCloseTopic) {
     StaticJsonDocument<200> doc;
-    DeserializationError error = deserializeJson(doc, message);
+    DeserializationError error = deserializeJson(doc, payload, length);
     if (error) {
       Serial.print("✗ Failed to parse gate command JSON: ");
       Serial.println(error.c_str());
@@ -425,18 +1326,18 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
     }
 
     int slotNumber = doc["slotNumber"] | 0;
-    String command = doc["command"] | String(isOpenTopic ? "open" : "close");
+    const char* command = doc["command"] | (isOpenTopic ? "open" : "close");
 
     if (slotNumber < 1 || slotNumber > 4) {
       Serial.println("✗ Invalid slot number in gate command");
       return;
     }
 
-    if (command == "open") {
+    if (strcmp(command, "open") == 0) {
       Serial.print("Opening entrance gate for slot ");
       Serial.println(slotNumber);
       openGate();
-    } else if (command == "close") {
+    } else if (strcmp(command, "close") == 0) {
       Serial.print("Closing entrance gate for slot ");
       Serial.println(slotNumber);
       closeGate();
@@ -447,6 +1348,137 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
   }
 }
 
+// ==================== LOCAL CONTROL PLANE ====================
+
+// Minimal HTTP/1.0 handler: one request per connection, fixed buffers.
+void handleLocalRequest(int clientSocket) {
+  struct timeval timeout = {1, 0};
+  setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  char request[LOCAL_REQUEST_SIZE];
+  size_t received = 0;
+  while (received < sizeof(request) - 1) {
+    int n = recv(clientSocket, request + received, sizeof(request) - 1 - received, 0);
+    if (n <= 0) {
+      break;
+    }
+    received += n;
+    request[received] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL) {
+      break;
+    }
+  }
+  request[received] = '\0';
+
+  char method[8] = "";
+  char path[32] = "";
+  sscanf(request, "%7s %31s", method, path);
+
+  // Look up the x-local-token header (case-insensitive name); the whole
+  // value must equal the token, not just start with it
+  bool authorized = false;
+  for (char* line = strstr(request, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+    const char* header = "x-local-token:";
+    if (strncasecmp(line + 2, header, strlen(header)) == 0) {
+      const char* value = line + 2 + strlen(header);
+      while (*value == ' ' || *value == '\t') {
+        value++;
+      }
+      size_t length = strcspn(value, "\r\n");
+      while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t')) {
+        length--;
+      }
+      authorized = length == strlen(LOCAL_CONTROL_TOKEN) && memcmp(value, LOCAL_CONTROL_TOKEN, length) == 0;
+      break;
+    }
+  }
+
+  int statusCode = 404;
+  const char* statusText = "Not Found";
+  char body[STATE_SNAPSHOT_SIZE] = "{\"error\":\"not found\"}";
+  const char* gateCommand = NULL;
+
+  if (strcmp(method, "OPTIONS") == 0) {
+    statusCode = 204;
+    statusText = "No Content";
+    body[0] = '\0';
+  } else if (strcmp(method, "GET") == 0 && strcmp(path, "/slots") == 0) {
+    statusCode = 200;
+    statusText = "OK";
+    StaticJsonDocument<768> snapshot;
+    buildStateSnapshot(snapshot);
+    serializeJson(snapshot, body, sizeof(body));
+  } else if (strcmp(method, "POST") == 0 && (strcmp(path, "/gate/open") == 0 || strcmp(path, "/gate/close") == 0)) {
+    if (!authorized) {
+      statusCode = 401;
+      statusText = "Unauthorized";
+      snprintf(body, sizeof(body), "{\"error\":\"invalid local token\"}");
+    } else {
+      gateCommand = strcmp(path, "/gate/open") == 0 ? "open" : "close";
+      statusCode = 200;
+      statusText = "OK";
+      snprintf(body, sizeof(body), "{\"ok\":true,\"command\":\"%s\"}", gateCommand);
+    }
+  }
+
+  char header[192];
+  int headerLength = snprintf(header, sizeof(header),
+                              "HTTP/1.0 %d %s\r\n"
+                              "Content-Type: application/json\r\n"
+                              "Access-Control-Allow-Origin: *\r\n"
+                              "Access-Control-Allow-Headers: x-local-token, content-type\r\n"
+                              "Content-Length: %u\r\n"
+                              "Connection: close\r\n\r\n",
+                              statusCode, statusText, (unsigned) strlen(body));
+  send(clientSocket, header, headerLength, 0);
+  send(clientSocket, body, strlen(body), 0);
+  close(clientSocket);
+
+  // Reply first; the gate path ends in a backend callback that may be slow
+  if (gateCommand != NULL) {
+    Serial.print("Local control: gate ");
+    Serial.println(gateCommand);
+    if (strcmp(gateCommand, "open") == 0) {
+      openGate();
+    } else {
+      closeGate();
+    }
+  }
+}
+
+// Push a change to every LAN listener; no-op until the local plane is up.
+void localBroadcast(const char* json) {
+  if (localUdpSocket < 0) {
+    return;
+  }
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(LOCAL_UDP_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+  sendto(localUdpSocket, json, strlen(json), 0, (struct sockaddr*) &addr, sizeof(addr));
+}
+
+void announceSlotLocal(int slotNumber, const char* status, uint64_t eventMs) {
+  StaticJsonDocument<256> doc;
+  doc["type"] = "slot";
+  doc["slotNumber"] = slotNumber;
+  doc["status"] = status;
+  stampMessage(doc, CHANNEL_LOCAL, eventMs);
+  char buffer[192];
+  serializeJson(doc, buffer, sizeof(buffer));
+  localBroadcast(buffer);
+}
+
+void announceGateLocal(const char* state, uint64_t eventMs) {
+  StaticJsonDocument<256> doc;
+  doc["type"] = "gate";
+  doc["state"] = state;
+  stampMessage(doc, CHANNEL_LOCAL, eventMs);
+  char buffer[192];
+  serializeJson(doc, buffer, sizeof(buffer));
+  localBroadcast(buffer);
+}
+
 // ==================== KEYPAD HANDLING ====================
 
 void handleKeypadInput() {
@@ -457,23 +1489,27 @@ void handleKeypadInput() {
     Serial.println(key);
     
     if (key == '#') {
-      if (voucherCode.length() == VOUCHER_LENGTH) {
+      if (voucherCodeLength == VOUCHER_LENGTH) {
         Serial.print("Validating voucher: ");
         Serial.println(voucherCode);
+        beginTrace();
         validateVoucher(voucherCode);
       } else {
         Serial.println("Invalid voucher length!");
         blinkError();
       }
-      voucherCode = "";
+      voucherCodeLength = 0;
+      voucherCode[0] = '\0';
     } 
     else if (key == '*') {
-      voucherCode = "";
+      voucherCodeLength = 0;
+      voucherCode[0] = '\0';
       Serial.println("Voucher cleared");
     }
     else if ((key >= '0' && key <= '9') || (key >= 'A' && key <= 'D')) {
-      if (voucherCode.length() < VOUCHER_LENGTH) {
-        voucherCode += key;
+      if (voucherCodeLength < VOUCHER_LENGTH) {
+        voucherCode[voucherCodeLength++] = key;
+        voucherCode[voucherCodeLength] = '\0';
         Serial.print("Voucher: ");
         Serial.println(voucherCode);
       }
@@ -483,36 +1519,26 @@ void handleKeypadInput() {
 
 // ==================== VOUCHER VALIDATION ====================
 
-void validateVoucher(String code) {
+void validateVoucher(const char* code) {
   if (WiFi.status() != WL_CONNECTED) {
     Serial.println("WiFi not connected!");
     blinkError();
     return;
   }
   
-  HTTPClient http;
-  String url = String(BACKEND_API_BASE) + "/iot/validate";
-  
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("x-device-token", DEVICE_TOKEN);
-  
-  StaticJsonDocument<200> doc;
+  StaticJsonDocument<256> doc;
   doc["code"] = code;
-  doc["deviceId"] = "esp32-main";
+  doc["deviceId"] = DEVICE_ID;
+  stampMessage(doc, CHANNEL_HTTP, wallClockMs());
   
-  String payload;
-  serializeJson(doc, payload);
-  Serial.print("POST ");
-  Serial.print(url);
-  Serial.print(" payload: ");
-  Serial.println(payload);
+  char payload[HTTP_BODY_SIZE];
+  serializeJson(doc, payload, sizeof(payload));
   
   Serial.println("Sending validation request...");
-  int httpCode = http.POST(payload);
+  char response[HTTP_RESPONSE_SIZE];
+  int httpCode = postBackend("/iot/validate", payload, true, response, sizeof(response));
   
   if (httpCode > 0) {
-    String response = http.getString();
     Serial.print("Response code: ");
     Serial.println(httpCode);
     Serial.print("Response: ");
@@ -520,7 +1546,7 @@ void validateVoucher(String code) {
     
     if (httpCode == 200) {
       StaticJsonDocument<200> responseDoc;
-      DeserializationError error = deserializeJson(responseDoc, response);
+      DeserializationError error = deserializeJson(responseDoc, (const char*) response);
       
       if (!error) {
         bool valid = responseDoc["valid"];
@@ -539,13 +1565,21 @@ void validateVoucher(String code) {
           digitalWrite(indicatorLedPin, HIGH);
           indicatorLedOn = true;
           logLedEvent("ON", slotNumber, "Voucher validated for slot");
+          markStateChanged();   // reservation must be persisted even if the gate is already open
           
           openGate();
           
           // Publish to MQTT
-          if (mqttClient.connected()) {
-            String topic = "parking/voucher/success";
-            mqttClient.publish(topic.c_str(), code.c_str());
+          if (mqttIsConnected()) {
+            StaticJsonDocument<256> voucherPayload;
+            voucherPayload["code"] = code;
+            voucherPayload["slotNumber"] = slotNumber;
+            voucherPayload["deviceId"] = DEVICE_ID;
+            stampMessage(voucherPayload, CHANNEL_MQTT, wallClockMs());
+            char buffer[192];
+            serializeJson(voucherPayload, buffer, sizeof(buffer));
+            const char* topic = "parking/voucher/success";
+            mqttPublish(topic, buffer);
             Serial.print("✓ Published to ");
             Serial.println(topic);
           }
@@ -554,9 +1588,16 @@ void validateVoucher(String code) {
         } else {
           Serial.println("✗ Invalid voucher!");
           
-          if (mqttClient.connected()) {
-            String topic = "parking/voucher/error";
-            mqttClient.publish(topic.c_str(), "invalid");
+          if (mqttIsConnected()) {
+            StaticJsonDocument<256> voucherPayload;
+            voucherPayload["code"] = code;
+            voucherPayload["error"] = "invalid";
+            voucherPayload["deviceId"] = DEVICE_ID;
+            stampMessage(voucherPayload, CHANNEL_MQTT, wallClockMs());
+            char buffer[192];
+            serializeJson(voucherPayload, buffer, sizeof(buffer));
+            const char* topic = "parking/voucher/error";
+            mqttPublish(topic, buffer);
             Serial.print("✓ Published to ");
             Serial.println(topic);
           }
@@ -570,11 +1611,12 @@ void validateVoucher(String code) {
     }
   } else {
     Serial.print("✗ HTTP request failed: ");
-    Serial.println(http.errorToString(httpCode));
+    Serial.println(HTTPClient::errorToString(httpCode));
     blinkError();
   }
-  
-  http.end();
+
+  // No admission started (invalid voucher / request failed) → drop the trace
+  endTraceIfIdle();
 }
 
 // ==================== SENSOR MONITORING ====================
@@ -586,25 +1628,34 @@ void checkAllSensors() {
 }
 
 void checkSensor(int index) {
-  if (millis() - lastSensorCheck[index] < SENSOR_DEBOUNCE) {
+  if (sensorDebouncing[index]) {
     return;
   }
   
   bool currentState = !digitalRead(irSensorPins[index]);
   
   if (currentState != sensorStates[index]) {
+    uint64_t eventMs = wallClockMs();     // edge time: IR beam change
     sensorStates[index] = currentState;
-    lastSensorCheck[index] = millis();
+    sensorDebouncing[index] = true;
+    timerStart(TIMER_SENSOR_DEBOUNCE + index, onSensorDebounceTimer, index, SENSOR_DEBOUNCE, 0);
     
-    String status = currentState ? "occupied" : "available";
+    const char* status = currentState ? "occupied" : "available";
     Serial.print("Slot ");
     Serial.print(index + 1);
     Serial.print(" sensor: ");
     Serial.println(status);
     
-    sendSensorUpdate(index + 1, status);
+    // LAN listeners first: they must not wait on the cloud round trip
+    announceSlotLocal(index + 1, status, eventMs);
+    if (sendSensorUpdate(index + 1, status, eventMs)) {
+      slotReportPending &= ~(1 << index);
+    } else {
+      slotReportPending |= 1 << index;
+    }
     
-    // Check if this is the reserved slot and it's now occupied
+    // Check if this is the reserved slot and it's now occupied (also on the
+    // boot pass: the car arrived while we were down)
     if (ledActiveForReservedSlot && (index + 1) == reservedSlotNumber && currentState) {
       Serial.print("✓ Vehicle arrived at reserved slot ");
       Serial.println(reservedSlotNumber);
@@ -624,8 +1675,8 @@ void checkSensor(int index) {
       
       reservedSlotNumber = -1;
     }
-    // Check if vehicle entered WRONG slot
-    else if (ledActiveForReservedSlot && (index + 1) != reservedSlotNumber && currentState) {
+    // Check if vehicle entered WRONG slot (cars already parked at boot don't count)
+    else if (!sensorBootPass && ledActiveForReservedSlot && (index + 1) != reservedSlotNumber && currentState) {
       Serial.print("✗ Vehicle entered WRONG slot! Reserved: ");
       Serial.print(reservedSlotNumber);
       Serial.print(", Actual: ");
@@ -636,7 +1687,9 @@ void checkSensor(int index) {
         digitalWrite(buzzerPin, HIGH);
         buzzerActive = true;
         buzzerActivationTime = millis();
-        logBuzzerEvent("ON", index + 1, "Wrong slot detected - vehicle should go to slot " + String(reservedSlotNumber));
+        char reason[64];
+        snprintf(reason, sizeof(reason), "Wrong slot detected - vehicle should go to slot %d", reservedSlotNumber);
+        logBuzzerEvent("ON", index + 1, reason);
       }
     }
     // Check if vehicle LEFT wrong slot
@@ -648,22 +1701,29 @@ void checkSensor(int index) {
     }
     
     // Publish to MQTT
-    if (mqttClient.connected()) {
-      String topic = "parking/slot/" + String(index + 1) + "/status";
-      StaticJsonDocument<200> payload;
+    if (mqttIsConnected()) {
+      char topic[32];
+      snprintf(topic, sizeof(topic), "parking/slot/%d/status", index + 1);
+      StaticJsonDocument<256> payload;
       payload["slotNumber"] = index + 1;
       payload["status"] = status;
-      payload["deviceId"] = "esp32-main";
-      char buffer[128];
+      payload["deviceId"] = DEVICE_ID;
+      stampMessage(payload, CHANNEL_MQTT, eventMs);
+      char buffer[192];
       serializeJson(payload, buffer, sizeof(buffer));
-      mqttClient.publish(topic.c_str(), buffer);
+      mqttPublish(topic, buffer);
       Serial.print("✓ Published to ");
       Serial.println(topic);
       Serial.print("Payload: ");
       Serial.println(buffer);
     }
     
-    if (!currentState && gateServoOpen) {
+    // Only now: the slot message above is the last hop of the admission trace
+    endTraceIfIdle();
+    markStateChanged();
+    
+    // Goes through the FSM: held as BLOCKED if a car is under the barrier
+    if (!currentState && !gateIsClosed()) {
       Serial.print("Vehicle left slot ");
       Serial.print(index + 1);
       Serial.println(", closing gate...");
@@ -672,119 +1732,372 @@ void checkSensor(int index) {
   }
 }
 
-void sendSensorUpdate(int slotNumber, String status) {
+// True once the backend answered (any HTTP status)
+bool sendSensorUpdate(int slotNumber, const char* status, uint64_t eventMs) {
   if (WiFi.status() != WL_CONNECTED) {
-    return;
+    return false;
   }
   
-  HTTPClient http;
-  String url = String(BACKEND_API_BASE) + "/iot/sensor-update";
-  
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("x-device-token", DEVICE_TOKEN);
-  
-  StaticJsonDocument<200> doc;
-  doc["deviceId"] = "esp32-main";
+  StaticJsonDocument<256> doc;
+  doc["deviceId"] = DEVICE_ID;
   doc["slotNumber"] = slotNumber;
   doc["sensorIndex"] = slotNumber - 1;
   doc["value"] = status;
+  stampMessage(doc, CHANNEL_HTTP, eventMs);
   
-  String payload;
-  serializeJson(doc, payload);
-  Serial.print("POST ");
-  Serial.print(url);
-  Serial.print(" payload: ");
-  Serial.println(payload);
+  char payload[HTTP_BODY_SIZE];
+  serializeJson(doc, payload, sizeof(payload));
   
-  int httpCode = http.POST(payload);
+  char response[HTTP_RESPONSE_SIZE];
+  int httpCode = postBackend("/iot/sensor-update", payload, false, response, sizeof(response));
   
   if (httpCode > 0) {
-    String response = http.getString();
+    markSensorReported();
     Serial.print("Sensor update sent: ");
     Serial.println(httpCode);
     Serial.print("Response body: ");
     Serial.println(response);
-  } else {
-    Serial.print("Sensor update failed: ");
-    Serial.println(http.errorToString(httpCode));
+    return true;
+  }
+  Serial.print("Sensor update failed: ");
+  Serial.println(HTTPClient::errorToString(httpCode));
+  return false;
+}
+
+// Called by TaskSensors after each pass; a slot still debouncing is left to
+// its own edge report.
+void resendPendingSlotReports() {
+  if (slotReportPending == 0 || WiFi.status() != WL_CONNECTED ||
+      (long) (millis() - slotReportRetryAt) < 0) {
+    return;
+  }
+  slotReportRetryAt = millis() + SLOT_REPORT_RETRY;
+  for (int i = 0; i < 4; i++) {
+    if (!(slotReportPending & (1 << i)) || sensorDebouncing[i]) {
+      continue;
+    }
+    if (sendSensorUpdate(i + 1, sensorStates[i] ? "occupied" : "available", 0)) {
+      slotReportPending &= ~(1 << i);
+    }
   }
-  
-  http.end();
 }
 
-// ==================== SERVO CONTROL ====================
+// ==================== GATE CONTROL ====================
 
+// Commands from any task are handed to TaskScheduler, which owns the FSM.
+// If two commands land before it runs, the latest one wins.
 void openGate() {
-  gateServo.write(SERVO_OPEN);
-  gateServoOpen = true;
-  gateServoOpenTime = millis();
-  
-  Serial.println("Entrance gate opened");
-  
-  sendServoCallback("open");
+  timerStart(TIMER_GATE_COMMAND, onGateCommandTimer, GATE_CMD_OPEN, 0, 0);
 }
 
 void closeGate() {
-  gateServo.write(SERVO_CLOSED);
-  gateServoOpen = false;
-  
-  Serial.println("Entrance gate closed");
-  
-  sendServoCallback("closed");
+  timerStart(TIMER_GATE_COMMAND, onGateCommandTimer, GATE_CMD_CLOSE, 0, 0);
+}
+
+bool gateIsClosed() {
+  return gateState == GATE_CLOSED;
+}
+
+void onGateCommandTimer(int command) {
+  if (command == GATE_CMD_CLOSE) {
+    gateRequestClose();
+    return;
+  }
+
+  switch (gateState) {
+    case GATE_CLOSED:
+      gateCycleStartedAt = millis();
+      setGateState(GATE_OPENING);
+      gateMoveTo(1.0f);
+      break;
+    case GATE_CLOSING:
+      setGateState(GATE_OPENING);
+      gateMoveTo(1.0f);
+      break;
+    case GATE_OPEN:
+      // Another admission while open: restart the auto-close window
+      timerStart(TIMER_GATE_AUTO_CLOSE, onGateAutoCloseTimer, 0, SERVO_AUTO_CLOSE_DELAY, 0);
+      break;
+    case GATE_BLOCKED:
+      // Beam already clear = the short clear-delay close is pending; the new
+      // car gets the full window instead of the barrier coming down on it
+      if (!gateBeamObstructed) {
+        setGateState(GATE_OPEN);
+        timerStart(TIMER_GATE_AUTO_CLOSE, onGateAutoCloseTimer, 0, SERVO_AUTO_CLOSE_DELAY, 0);
+      }
+      break;
+    default:
+      break;   // OPENING: already on the way
+  }
+}
+
+// Close unless something is under the barrier; then hold it as BLOCKED and
+// let the beam-clear edge close it.
+void gateRequestClose() {
+  if (gateState == GATE_CLOSED || gateState == GATE_CLOSING) {
+    return;
+  }
+  if (gateBeamObstructed) {
+    Serial.println("Gate close deferred: beam obstructed");
+    if (gateState == GATE_OPEN) {
+      timerCancel(TIMER_GATE_AUTO_CLOSE);
+      setGateState(GATE_BLOCKED);
+    }
+    return;   // OPENING ends in BLOCKED when it arrives
+  }
+  timerCancel(TIMER_GATE_AUTO_CLOSE);
+  setGateState(GATE_CLOSING);
+  gateMoveTo(0.0f);
+}
+
+void onGateAutoCloseTimer(int arg) {
+  (void) arg;
+  Serial.println("Auto-closing entrance gate (timer)");
+  gateRequestClose();
+}
+
+void onGateBeamTimer(int obstructed) {
+  if (obstructed) {
+    switch (gateState) {
+      case GATE_CLOSING:
+        gateReversals++;
+        Serial.println("✗ Gate beam obstructed while closing - reversing");
+        setGateState(GATE_OPENING);
+        gateMoveTo(1.0f);
+        break;
+      case GATE_OPEN:
+        timerCancel(TIMER_GATE_AUTO_CLOSE);
+        setGateState(GATE_BLOCKED);
+        break;
+      case GATE_BLOCKED:
+        timerCancel(TIMER_GATE_AUTO_CLOSE);   // re-obstructed during the clear delay
+        break;
+      default:
+        break;
+    }
+  } else if (gateState == GATE_BLOCKED) {
+    timerStart(TIMER_GATE_AUTO_CLOSE, onGateAutoCloseTimer, 0, GATE_BEAM_CLEAR_DELAY, 0);
+  }
+}
+
+// Beam edge interrupt (Active LOW like the slot sensors). Runs independently
+// of TaskSensors, whose pass can stall behind slot HTTP calls; arms the FSM
+// event directly since timerStart() is not ISR-safe. The latest level wins.
+void IRAM_ATTR onGateBeamEdge() {
+  bool obstructed = !digitalRead(gateBeamPin);
+  if (obstructed == gateBeamObstructed) {
+    return;
+  }
+  gateBeamObstructed = obstructed;
+
+  portENTER_CRITICAL_ISR(&timerMux);
+  timers[TIMER_GATE_BEAM].callback = onGateBeamTimer;
+  timers[TIMER_GATE_BEAM].arg = obstructed;
+  timers[TIMER_GATE_BEAM].deadline = millis();
+  timers[TIMER_GATE_BEAM].periodMs = 0;
+  timers[TIMER_GATE_BEAM].armed = true;
+  portEXIT_CRITICAL_ISR(&timerMux);
+
+  if (taskSchedulerHandle != NULL) {
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(taskSchedulerHandle, &higherPriorityTaskWoken);
+    if (higherPriorityTaskWoken) {
+      portYIELD_FROM_ISR();
+    }
+  }
+}
+
+void setGateState(GateState newState) {
+  if (newState == gateState) {
+    return;
+  }
+  Serial.print("Entrance gate: ");
+  Serial.print(GATE_STATE_NAMES[gateState]);
+  Serial.print(" → ");
+  Serial.println(GATE_STATE_NAMES[newState]);
+
+  gateState = newState;
+  markStateChanged();
+  announceGateLocal(GATE_STATE_NAMES[newState], wallClockMs());
+}
+
+// ---------- Motion (LEDC hardware fades) ----------
+
+void initGateServo(float startPosition) {
+  ledc_timer_config_t timerConfig = {};
+  timerConfig.speed_mode = GATE_LEDC_MODE;
+  timerConfig.duty_resolution = GATE_LEDC_RESOLUTION;
+  timerConfig.timer_num = GATE_LEDC_TIMER;
+  timerConfig.freq_hz = SERVO_PWM_HZ;
+  timerConfig.clk_cfg = LEDC_AUTO_CLK;
+  ledc_timer_config(&timerConfig);
+
+  ledc_channel_config_t channelConfig = {};
+  channelConfig.gpio_num = gateServoPin;
+  channelConfig.speed_mode = GATE_LEDC_MODE;
+  channelConfig.channel = GATE_LEDC_CHANNEL;
+  channelConfig.timer_sel = GATE_LEDC_TIMER;
+  channelConfig.duty = gateDutyFor(startPosition);
+  channelConfig.hpoint = 0;
+  ledc_channel_config(&channelConfig);
+
+  ledc_fade_func_install(0);
+  gatePosition = startPosition;
+  gateMotionTo = startPosition;
+  gateTarget = startPosition;
+}
+
+// Travel fraction (0 = SERVO_CLOSED, 1 = SERVO_OPEN) → LEDC duty
+uint32_t gateDutyFor(float fraction) {
+  float angle = SERVO_CLOSED + (SERVO_OPEN - SERVO_CLOSED) * fraction;
+  float pulseUs = SERVO_MIN_PULSE_US + angle * (SERVO_MAX_PULSE_US - SERVO_MIN_PULSE_US) / 180.0f;
+  return (uint32_t) (pulseUs * SERVO_PWM_HZ * (1 << GATE_LEDC_RESOLUTION) / 1000000.0f);
+}
+
+// A segment's fade cannot be aborted, so a new target (reversal) is picked
+// up when the current segment ends, at most GATE_MOTION_MS / 8 later.
+void gateMoveTo(float target) {
+  gateTarget = target;
+  if (!timerArmed(TIMER_GATE_MOTION)) {
+    gatePlanMotion();
+  }
+}
+
+void gatePlanMotion() {
+  float distance = fabsf(gateTarget - gatePosition);
+  gateMotionFrom = gatePosition;
+  gateMotionTo = gateTarget;
+  gateMotionSegment = 0;
+  if (distance < 0.001f) {
+    onGateMotionDone();
+    return;
+  }
+  // Same acceleration for any distance: move time scales with sqrt(distance)
+  unsigned long moveMs = (unsigned long) (GATE_MOTION_MS * sqrtf(distance));
+  gateSegmentMs = max(moveMs / GATE_PROFILE_SEGMENTS, 1000UL / SERVO_PWM_HZ);
+  gateMotionStep();
+}
+
+void gateMotionStep() {
+  if (gateMotionSegment >= GATE_PROFILE_SEGMENTS) {
+    onGateMotionDone();
+    return;
+  }
+  gateMotionSegment++;
+  float next = gateMotionFrom + (gateMotionTo - gateMotionFrom) * GATE_PROFILE[gateMotionSegment];
+  // Blocks only if the previous fade overran its slot by a PWM period or so
+  ledc_set_fade_with_time(GATE_LEDC_MODE, GATE_LEDC_CHANNEL, gateDutyFor(next), gateSegmentMs);
+  ledc_fade_start(GATE_LEDC_MODE, GATE_LEDC_CHANNEL, LEDC_FADE_NO_WAIT);
+  timerStart(TIMER_GATE_MOTION, onGateMotionTimer, 0, gateSegmentMs, 0);
+}
+
+void onGateMotionTimer(int arg) {
+  (void) arg;
+  gatePosition = gateMotionFrom + (gateMotionTo - gateMotionFrom) * GATE_PROFILE[gateMotionSegment];
+  if (gateTarget != gateMotionTo) {
+    gatePlanMotion();   // reversal requested mid-move
+  } else {
+    gateMotionStep();
+  }
+}
+
+void onGateMotionDone() {
+  gatePosition = gateMotionTo;
+  uint64_t eventMs = wallClockMs();
+
+  if (gateMotionTo >= 1.0f) {
+    if (gateBeamObstructed) {
+      setGateState(GATE_BLOCKED);
+    } else {
+      setGateState(GATE_OPEN);
+      timerStart(TIMER_GATE_AUTO_CLOSE, onGateAutoCloseTimer, 0, SERVO_AUTO_CLOSE_DELAY, 0);
+    }
+    postNetJob(NET_JOB_SERVO_CALLBACK, "open", eventMs);
+  } else {
+    setGateState(GATE_CLOSED);
+    recordGateCycle();
+    postNetJob(NET_JOB_SERVO_CALLBACK, "closed", eventMs);
+    endTraceIfIdle();
+  }
+}
+
+// ---------- Metrics ----------
+
+void recordGateCycle() {
+  if (gateCycleStartedAt == 0) {
+    return;
+  }
+  unsigned long cycleMs = millis() - gateCycleStartedAt;
+  gateCycleStartedAt = 0;
+  gateCycles++;
+  gateLastCycleMs = cycleMs;
+  gateAvgCycleMs = gateAvgCycleMs == 0 ? cycleMs : (gateAvgCycleMs * 7 + cycleMs) / 8;
+
+  uint32_t slice = millis() / GATE_RATE_BUCKET_MS;
+  int bucket = slice % GATE_RATE_BUCKETS;
+  if (gateRateSlice[bucket] != slice) {
+    gateRateSlice[bucket] = slice;
+    gateRateCount[bucket] = 0;
+  }
+  gateRateCount[bucket]++;
+
+  Serial.printf("Gate cycle #%lu: %lu ms (avg %lu ms, capacity %lu veh/h, last hour %lu veh)\n",
+                (unsigned long) gateCycles, cycleMs, gateAvgCycleMs,
+                gateCapacityPerHour(), gateVehiclesLastHour());
 }
 
-void handleAutoCloseGate() {
-  if (gateServoOpen && millis() - gateServoOpenTime >= SERVO_AUTO_CLOSE_DELAY) {
-    Serial.println("Auto-closing entrance gate (timer)");
-    closeGate();
+// Vehicles admitted (completed gate cycles) in the last hour
+unsigned long gateVehiclesLastHour() {
+  uint32_t slice = millis() / GATE_RATE_BUCKET_MS;
+  unsigned long total = 0;
+  for (int i = 0; i < GATE_RATE_BUCKETS; i++) {
+    if (slice - gateRateSlice[i] < (uint32_t) GATE_RATE_BUCKETS) {
+      total += gateRateCount[i];
+    }
   }
+  return total;
+}
+
+// Throughput ceiling if cycles ran back to back at the average cycle time
+unsigned long gateCapacityPerHour() {
+  return gateAvgCycleMs > 0 ? 3600000UL / gateAvgCycleMs : 0;
 }
 
-void sendServoCallback(String state) {
+void sendServoCallback(const char* state, uint64_t eventMs, const char* traceId) {
   if (WiFi.status() != WL_CONNECTED) {
     return;
   }
   
-  HTTPClient http;
-  String url = String(BACKEND_API_BASE) + "/iot/servo-callback";
-  
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("x-device-token", DEVICE_TOKEN);
-  
-  StaticJsonDocument<200> doc;
-  doc["deviceId"] = "esp32-main";
+  StaticJsonDocument<256> doc;
+  doc["deviceId"] = DEVICE_ID;
   doc["servoState"] = state;
+  stampMessage(doc, CHANNEL_HTTP, eventMs, traceId);
   
-  String payload;
-  serializeJson(doc, payload);
-  Serial.print("POST ");
-  Serial.print(url);
-  Serial.print(" payload: ");
-  Serial.println(payload);
+  char payload[HTTP_BODY_SIZE];
+  serializeJson(doc, payload, sizeof(payload));
   
-  int httpCode = http.POST(payload);
+  char response[HTTP_RESPONSE_SIZE];
+  int httpCode = postBackend("/iot/servo-callback", payload, false, response, sizeof(response));
   if (httpCode > 0) {
     Serial.print("Servo callback status: ");
     Serial.println(httpCode);
     Serial.print("Response body: ");
-    Serial.println(http.getString());
+    Serial.println(response);
   } else {
     Serial.print("Servo callback failed: ");
-    Serial.println(http.errorToString(httpCode));
+    Serial.println(HTTPClient::errorToString(httpCode));
   }
-  http.end();
   
   // Publish to MQTT
-  if (mqttClient.connected()) {
-    StaticJsonDocument<200> gatePayload;
+  if (mqttIsConnected()) {
+    StaticJsonDocument<256> gatePayload;
     gatePayload["state"] = state;
-    gatePayload["deviceId"] = "esp32-main";
-    char buffer[128];
+    gatePayload["deviceId"] = DEVICE_ID;
+    stampMessage(gatePayload, CHANNEL_MQTT, eventMs, traceId);
+    char buffer[192];
     serializeJson(gatePayload, buffer, sizeof(buffer));
     const char* topic = "parking/gate/state";
-    mqttClient.publish(topic, buffer);
+    mqttPublish(topic, buffer);
     Serial.print("✓ Published to ");
     Serial.println(topic);
     Serial.print("Payload: ");
@@ -792,25 +2105,851 @@ void sendServoCallback(String state) {
   }
 }
 
+// ==================== STATE SNAPSHOT ====================
+
+// The one document describing the whole lot. Used for the retained
+// parking/state message and for the local GET /slots endpoint.
+void buildStateSnapshot(JsonDocument& doc) {
+  doc["deviceId"] = DEVICE_ID;
+  doc["version"] = stateVersion;
+  doc["gate"] = GATE_STATE_NAMES[gateState];
+  doc["led"] = indicatorLedOn ? "on" : "off";
+  doc["buzzer"] = buzzerActive ? "on" : "off";
+  doc["reservedSlot"] = reservedSlotNumber;
+  JsonArray slots = doc.createNestedArray("slots");
+  for (int i = 0; i < 4; i++) {
+    JsonObject slot = slots.createNestedObject();
+    slot["slotNumber"] = i + 1;
+    slot["status"] = sensorStates[i] ? "occupied" : "available";
+  }
+  JsonObject gate = doc.createNestedObject("gateMetrics");
+  gate["cycles"] = gateCycles;
+  gate["lastCycleMs"] = gateLastCycleMs;
+  gate["avgCycleMs"] = gateAvgCycleMs;
+  gate["vehiclesLastHour"] = gateVehiclesLastHour();
+  gate["capacityPerHour"] = gateCapacityPerHour();
+  gate["reversals"] = gateReversals;
+}
+
+// Bump the version, persist, and publish shortly after; a burst of changes from one
+// event (slot + LED + buzzer + gate) goes out as a single snapshot.
+void markStateChanged() {
+  portENTER_CRITICAL(&stateVersionMux);
+  stateVersion++;   // read-modify-write: a lost bump would repeat a version
+  portEXIT_CRITICAL(&stateVersionMux);
+  persistState();
+  timerStart(TIMER_STATE_PUBLISH, onStatePublishTimer, 0, STATE_PUBLISH_COALESCE, 0);
+}
+
+void onStatePublishTimer(int arg) {
+  (void) arg;
+  postNetJob(NET_JOB_STATE_PUBLISH, NULL, 0);
+}
+
+void publishStateSnapshot() {
+  if (!mqttIsConnected()) {
+    return;   // the reconnect path publishes the latest state anyway
+  }
+  StaticJsonDocument<768> doc;
+  buildStateSnapshot(doc);
+  stampMessage(doc, CHANNEL_MQTT, wallClockMs());
+  char buffer[STATE_SNAPSHOT_SIZE];
+  serializeJson(doc, buffer, sizeof(buffer));
+  const char* topic = "parking/state";
+  if (mqttPublish(topic, buffer, true)) {   // retained
+    markSensorReported();
+  }
+  Serial.print("✓ Published to ");
+  Serial.print(topic);
+  Serial.print(" (v");
+  Serial.print(stateVersion);
+  Serial.println(")");
+}
+
+// ==================== BACKEND TRANSPORT ====================
+
+// Serialised entry point for every backend request. The response body is
+// copied (truncated, NUL-terminated) into `response`.
+int postBackend(const char* path, const char* body, bool reliable, char* response, size_t responseSize) {
+  response[0] = '\0';
+
+  Serial.print("POST (");
+  Serial.print(backendTransport->name());
+  Serial.print(reliable ? ", reliable) " : ", telemetry) ");
+  Serial.print(path);
+  Serial.print(" payload: ");
+  Serial.println(body);
+
+  xSemaphoreTake(transportMutex, portMAX_DELAY);
+  int code = backendTransport->post(path, body, reliable, response, responseSize);
+  xSemaphoreGive(transportMutex);
+
+  return code;
+}
+
+// ---------- HTTP ----------
+
+template <class ClientType>
+int HttpTransport<ClientType>::post(const char* path, const char* body, bool reliable, char* response, size_t responseSize) {
+  (void) reliable;  // TCP: every request is acknowledged anyway
+  char url[HTTP_URL_SIZE];
+  snprintf(url, sizeof(url), "%s%s", baseUrl, path);
+
+  http.setReuse(true);
+  http.begin(client, url);
+  http.addHeader("Content-Type", "application/json");
+  http.addHeader("x-device-token", DEVICE_TOKEN);
+
+  int httpCode = http.POST((uint8_t*) body, strlen(body));
+
+  if (httpCode > 0) {
+    // Read straight from the socket instead of getString() (no String alloc)
+    int bodySize = http.getSize();
+    WiFiClient* stream = http.getStreamPtr();
+    size_t wanted = responseSize - 1;
+    if (bodySize >= 0 && (size_t) bodySize < wanted) {
+      wanted = bodySize;
+    }
+    size_t length = stream ? stream->readBytes(response, wanted) : 0;
+    response[length] = '\0';
+  }
+
+  http.end();
+  return httpCode;
+}
+
+// ---------- CoAP ----------
+
+const uint8_t COAP_VERSION          = 1;
+const uint8_t COAP_TYPE_CON         = 0;
+const uint8_t COAP_TYPE_NON         = 1;
+const uint8_t COAP_TYPE_ACK         = 2;
+const uint8_t COAP_CODE_EMPTY       = 0x00;
+const uint8_t COAP_CODE_POST        = 0x02;
+const uint8_t COAP_OPTION_URI_PATH  = 11;
+const uint8_t COAP_OPTION_CONTENT_FORMAT = 12;
+const uint8_t COAP_OPTION_URI_QUERY = 15;
+const uint8_t COAP_FORMAT_JSON      = 50;
+const uint8_t COAP_PAYLOAD_MARKER   = 0xFF;
+const size_t  COAP_TOKEN_LENGTH     = 4;
+
+// Tuned for a single lot WiFi hop instead of RFC 7252's 2 s / 4 retries
+const uint32_t COAP_ACK_TIMEOUT_MS   = 500;
+const int      COAP_MAX_RETRANSMIT   = 3;
+const uint32_t COAP_SEPARATE_TIMEOUT_MS = 5000;   // after an empty ACK
+
+// Option delta/length nibble + extended bytes (RFC 7252 §3.1)
+static size_t coapPutOption(uint8_t* out, size_t pos, size_t size, unsigned delta, const uint8_t* value, size_t length) {
+  uint8_t deltaNibble = delta < 13 ? delta : (delta < 269 ? 13 : 14);
+  uint8_t lengthNibble = length < 13 ? length : (length < 269 ? 13 : 14);
+  if (pos + 5 + length > size) {
+    return 0;
+  }
+  out[pos++] = (deltaNibble << 4) | lengthNibble;
+  if (deltaNibble == 13) {
+    out[pos++] = delta - 13;
+  } else if (deltaNibble == 14) {
+    out[pos++] = (delta - 269) >> 8;
+    out[pos++] = (delta - 269) & 0xFF;
+  }
+  if (lengthNibble == 13) {
+    out[pos++] = length - 13;
+  } else if (lengthNibble == 14) {
+    out[pos++] = (length - 269) >> 8;
+    out[pos++] = (length - 269) & 0xFF;
+  }
+  memcpy(out + pos, value, length);
+  return pos + length;
+}
+
+size_t CoapTransport::buildRequest(uint8_t* out, size_t size, bool confirmable, uint16_t messageId,
+                                   const uint8_t* token, const char* path, const char* body) {
+  size_t pos = 0;
+  out[pos++] = (COAP_VERSION << 6) | ((confirmable ? COAP_TYPE_CON : COAP_TYPE_NON) << 4) | COAP_TOKEN_LENGTH;
+  out[pos++] = COAP_CODE_POST;
+  out[pos++] = messageId >> 8;
+  out[pos++] = messageId & 0xFF;
+  memcpy(out + pos, token, COAP_TOKEN_LENGTH);
+  pos += COAP_TOKEN_LENGTH;
+
+  // Uri-Path: one option per segment of COAP_URI_PREFIX + path
+  char fullPath[HTTP_URL_SIZE];
+  snprintf(fullPath, sizeof(fullPath), "%s%s", COAP_URI_PREFIX, path);
+  unsigned lastOption = 0;
+  const char* segment = fullPath;
+  while (*segment != '\0') {
+    if (*segment == '/') {
+      segment++;
+      continue;
+    }
+    const char* end = strchr(segment, '/');
+    size_t length = end ? (size_t) (end - segment) : strlen(segment);
+    pos = coapPutOption(out, pos, size, COAP_OPTION_URI_PATH - lastOption, (const uint8_t*) segment, length);
+    if (pos == 0) {
+      return 0;
+    }
+    lastOption = COAP_OPTION_URI_PATH;
+    segment += length;
+  }
+
+  pos = coapPutOption(out, pos, size, COAP_OPTION_CONTENT_FORMAT - lastOption, &COAP_FORMAT_JSON, 1);
+  if (pos == 0) {
+    return 0;
+  }
+  lastOption = COAP_OPTION_CONTENT_FORMAT;
+
+  // The proxy maps ?token= to the x-device-token header
+  char query[64];
+  int queryLength = snprintf(query, sizeof(query), "token=%s", DEVICE_TOKEN);
+  pos = coapPutOption(out, pos, size, COAP_OPTION_URI_QUERY - lastOption, (const uint8_t*) query, queryLength);
+  if (pos == 0) {
+    return 0;
+  }
+
+  size_t bodyLength = strlen(body);
+  if (pos + 1 + bodyLength > size) {
+    return 0;
+  }
+  out[pos++] = COAP_PAYLOAD_MARKER;
+  memcpy(out + pos, body, bodyLength);
+  return pos + bodyLength;
+}
+
+// Skip the options of a received message; returns the payload offset or `length`.
+static size_t coapPayloadOffset(const uint8_t* message, size_t length) {
+  size_t pos = 4 + (message[0] & 0x0F);
+  while (pos < length && message[pos] != COAP_PAYLOAD_MARKER) {
+    uint8_t deltaNibble = message[pos] >> 4;
+    uint8_t lengthNibble = message[pos] & 0x0F;
+    pos++;
+    if (deltaNibble == 15 || lengthNibble == 15) {
+      return length;
+    }
+    pos += deltaNibble == 13 ? 1 : (deltaNibble == 14 ? 2 : 0);
+    size_t optionLength = lengthNibble;
+    if (lengthNibble == 13 && pos < length) {
+      optionLength = message[pos] + 13;
+      pos += 1;
+    } else if (lengthNibble == 14 && pos + 1 < length) {
+      optionLength = ((message[pos] << 8) | message[pos + 1]) + 269;
+      pos += 2;
+    }
+    pos += optionLength;
+  }
+  return pos < length ? pos + 1 : length;
+}
+
+int CoapTransport::post(const char* path, const char* body, bool reliable, char* response, size_t responseSize) {
+  if (!ensureSession()) {
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+  }
+
+  uint16_t messageId = nextMessageId++;
+  uint32_t tokenValue = esp_random();
+  uint8_t token[COAP_TOKEN_LENGTH];
+  memcpy(token, &tokenValue, COAP_TOKEN_LENGTH);
+
+  uint8_t request[COAP_MAX_MESSAGE];
+  size_t requestLength = buildRequest(request, sizeof(request), reliable, messageId, token, path, body);
+  if (requestLength == 0) {
+    return HTTPC_ERROR_ENCODING;
+  }
+
+  // Telemetry: non-confirmable, the next reading supersedes a lost one
+  if (!reliable) {
+    return sendDatagram(request, requestLength) < 0 ? HTTPC_ERROR_SEND_PAYLOAD_FAILED : TRANSPORT_SENT_NO_REPLY;
+  }
+
+  uint32_t timeoutMs = COAP_ACK_TIMEOUT_MS + esp_random() % (COAP_ACK_TIMEOUT_MS / 2);
+  for (int attempt = 0; attempt <= COAP_MAX_RETRANSMIT; attempt++) {
+    if (sendDatagram(request, requestLength) < 0) {
+      break;
+    }
+
+    unsigned long deadline = millis() + timeoutMs;
+    for (;;) {
+      long remaining = (long) (deadline - millis());
+      if (remaining <= 0) {
+        break;
+      }
+      uint8_t reply[COAP_MAX_MESSAGE];
+      int length = receiveDatagram(reply, sizeof(reply), remaining);
+      if (length < 0) {
+        closeSession();
+        return HTTPC_ERROR_CONNECTION_LOST;
+      }
+      if (length == 0) {
+        break;  // timeout → retransmit
+      }
+      if (length < 4 || (reply[0] >> 6) != COAP_VERSION) {
+        continue;
+      }
+
+      uint8_t type = (reply[0] >> 4) & 0x03;
+      uint8_t tokenLength = reply[0] & 0x0F;
+      uint8_t code = reply[1];
+      uint16_t replyId = (reply[2] << 8) | reply[3];
+
+      if (type == COAP_TYPE_ACK && replyId == messageId && code == COAP_CODE_EMPTY) {
+        // Empty ACK: the response comes later as a separate message
+        deadline = millis() + COAP_SEPARATE_TIMEOUT_MS;
+        attempt = COAP_MAX_RETRANSMIT;
+        continue;
+      }
+      if (tokenLength != COAP_TOKEN_LENGTH || (size_t) length < 4 + COAP_TOKEN_LENGTH ||
+          memcmp(reply + 4, token, COAP_TOKEN_LENGTH) != 0) {
+        continue;   // stale reply to an earlier request
+      }
+      if (type == COAP_TYPE_CON) {
+        uint8_t ack[4] = {(uint8_t) ((COAP_VERSION << 6) | (COAP_TYPE_ACK << 4)), COAP_CODE_EMPTY, reply[2], reply[3]};
+        sendDatagram(ack, sizeof(ack));
+      }
+
+      size_t payload = coapPayloadOffset(reply, length);
+      size_t copy = min((size_t) length - payload, responseSize - 1);
+      memcpy(response, reply + payload, copy);
+      response[copy] = '\0';
+
+      // Map c.dd → HTTP status (all 2.xx success codes → 200)
+      uint8_t codeClass = code >> 5;
+      return codeClass == 2 ? 200 : codeClass * 100 + (code & 0x1F);
+    }
+    timeoutMs *= 2;
+  }
+
+  closeSession();   // force a fresh (D)TLS session next time
+  return HTTPC_ERROR_READ_TIMEOUT;
+}
+
+bool CoapTransport::ensureSession() {
+  if (sock >= 0) {
+    return true;
+  }
+
+  IPAddress ip;
+  if (!WiFi.hostByName(host, ip)) {
+    return false;
+  }
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    return false;
+  }
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = (uint32_t) ip;
+  if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+    closeSession();
+    return false;
+  }
+  nextMessageId = esp_random() & 0xFFFF;
+
+#if COAP_DTLS_ENABLED
+  if (useDtls) {
+    static const int ciphersuites[] = {MBEDTLS_TLS_PSK_WITH_AES_128_CCM_8, 0};  // RFC 7252 §9.1.3.1
+    if (!dtlsConfigured) {
+      mbedtls_ssl_init(&ssl);
+      mbedtls_ssl_config_init(&conf);
+      mbedtls_entropy_init(&entropy);
+      mbedtls_ctr_drbg_init(&drbg);
+      // Any failure here (notably an unseeded DRBG) must not reach the handshake
+      int ret = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, (const unsigned char*) DEVICE_ID, strlen(DEVICE_ID));
+      if (ret == 0) {
+        ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_DATAGRAM, MBEDTLS_SSL_PRESET_DEFAULT);
+      }
+      if (ret == 0) {
+        mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+        ret = mbedtls_ssl_conf_psk(&conf, (const unsigned char*) COAP_PSK_KEY, strlen(COAP_PSK_KEY),
+                                   (const unsigned char*) COAP_PSK_IDENTITY, strlen(COAP_PSK_IDENTITY));
+      }
+      if (ret == 0) {
+        mbedtls_ssl_conf_ciphersuites(&conf, ciphersuites);
+        mbedtls_ssl_conf_handshake_timeout(&conf, 1000, 8000);
+        ret = mbedtls_ssl_setup(&ssl, &conf);
+      }
+      if (ret != 0) {
+        Serial.print("✗ DTLS setup failed: -0x");
+        Serial.println(-ret, HEX);
+        mbedtls_ssl_free(&ssl);
+        mbedtls_ssl_config_free(&conf);
+        mbedtls_ctr_drbg_free(&drbg);
+        mbedtls_entropy_free(&entropy);
+        closeSession();
+        return false;
+      }
+      mbedtls_ssl_set_timer_cb(&ssl, this, dtlsSetDelay, dtlsGetDelay);
+      dtlsConfigured = true;
+    }
+    mbedtls_ssl_session_reset(&ssl);
+    mbedtls_ssl_set_bio(&ssl, this, dtlsSend, NULL, dtlsReceive);
+
+    int ret;
+    do {
+      ret = mbedtls_ssl_handshake(&ssl);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+    if (ret != 0) {
+      Serial.print("✗ DTLS handshake failed: -0x");
+      Serial.println(-ret, HEX);
+      closeSession();
+      return false;
+    }
+    Serial.println("✓ DTLS session established");
+  }
+#endif
+  return true;
+}
+
+void CoapTransport::closeSession() {
+#if COAP_DTLS_ENABLED
+  if (useDtls && dtlsConfigured && sock >= 0) {
+    mbedtls_ssl_close_notify(&ssl);
+  }
+#endif
+  if (sock >= 0) {
+    close(sock);
+    sock = -1;
+  }
+}
+
+int CoapTransport::sendDatagram(const uint8_t* data, size_t length) {
+#if COAP_DTLS_ENABLED
+  if (useDtls) {
+    return mbedtls_ssl_write(&ssl, data, length);
+  }
+#endif
+  int n = rawSend(sock, data, length);
+  if (n > 0) {
+    sent += n;
+  }
+  return n;
+}
+
+// Returns bytes read, 0 on timeout, < 0 on error
+int CoapTransport::receiveDatagram(uint8_t* data, size_t size, uint32_t timeoutMs) {
+#if COAP_DTLS_ENABLED
+  if (useDtls) {
+    mbedtls_ssl_conf_read_timeout(&conf, timeoutMs);
+    int n = mbedtls_ssl_read(&ssl, data, size);
+    if (n == MBEDTLS_ERR_SSL_TIMEOUT || n == MBEDTLS_ERR_SSL_WANT_READ) {
+      return 0;
+    }
+    return n;
+  }
+#endif
+  int n = rawReceive(sock, data, size, timeoutMs);
+  if (n > 0) {
+    received += n;
+  }
+  return n;
+}
+
+int CoapTransport::rawSend(int sock, const uint8_t* data, size_t length) {
+  return send(sock, data, length, 0);
+}
+
+int CoapTransport::rawReceive(int sock, uint8_t* data, size_t size, uint32_t timeoutMs) {
+  struct timeval timeout;
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_usec = (timeoutMs % 1000) * 1000;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  int n = recv(sock, data, size, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  return n;
+}
+
+#if COAP_DTLS_ENABLED
+// mbedTLS BIO + timer callbacks; byte counters include DTLS record overhead
+
+int CoapTransport::dtlsSend(void* ctx, const unsigned char* data, size_t length) {
+  CoapTransport* self = (CoapTransport*) ctx;
+  int n = rawSend(self->sock, data, length);
+  if (n < 0) {
+    return MBEDTLS_ERR_NET_SEND_FAILED;
+  }
+  self->sent += n;
+  return n;
+}
+
+int CoapTransport::dtlsReceive(void* ctx, unsigned char* data, size_t size, uint32_t timeoutMs) {
+  CoapTransport* self = (CoapTransport*) ctx;
+  int n = rawReceive(self->sock, data, size, timeoutMs == 0 ? 60000 : timeoutMs);
+  if (n == 0) {
+    return MBEDTLS_ERR_SSL_TIMEOUT;
+  }
+  if (n < 0) {
+    return MBEDTLS_ERR_NET_RECV_FAILED;
+  }
+  self->received += n;
+  return n;
+}
+
+void CoapTransport::dtlsSetDelay(void* ctx, uint32_t intermediateMs, uint32_t finalMs) {
+  CoapTransport* self = (CoapTransport*) ctx;
+  self->timerStartMs = millis();
+  self->timerIntermediateMs = intermediateMs;
+  self->timerFinalMs = finalMs;
+}
+
+// -1 = cancelled, 0 = running, 1 = intermediate passed, 2 = final passed
+int CoapTransport::dtlsGetDelay(void* ctx) {
+  CoapTransport* self = (CoapTransport*) ctx;
+  if (self->timerFinalMs == 0) {
+    return -1;
+  }
+  unsigned long elapsed = millis() - self->timerStartMs;
+  if (elapsed >= self->timerFinalMs) {
+    return 2;
+  }
+  if (elapsed >= self->timerIntermediateMs) {
+    return 1;
+  }
+  return 0;
+}
+#endif
+
+// ---------- Benchmark ----------
+
+#if TRANSPORT_BENCHMARK
+static void printBenchResult(const char* label, uint32_t* samples, int count, size_t bytesOut, size_t bytesIn) {
+  // Insertion sort: BENCH_ITERATIONS is small
+  for (int i = 1; i < count; i++) {
+    uint32_t value = samples[i];
+    int j = i - 1;
+    while (j >= 0 && samples[j] > value) {
+      samples[j + 1] = samples[j];
+      j--;
+    }
+    samples[j + 1] = value;
+  }
+  if (count == 0) {
+    Serial.printf("[BENCH] %-5s no successful round trips\n", label);
+    return;
+  }
+  Serial.printf("[BENCH] %-5s n=%d rtt us min=%lu p50=%lu p95=%lu max=%lu | bytes/req tx=%u rx=%u\n",
+                label, count,
+                (unsigned long) samples[0], (unsigned long) samples[count / 2],
+                (unsigned long) samples[(count * 95) / 100 < count ? (count * 95) / 100 : count - 1],
+                (unsigned long) samples[count - 1],
+                (unsigned) (bytesOut / count), (unsigned) (bytesIn / count));
+}
+
+static void benchTransport(BackendTransport& transport, const char* label, const char* body) {
+  uint32_t samples[BENCH_ITERATIONS];
+  char response[HTTP_RESPONSE_SIZE];
+  int count = 0;
+  size_t sentBefore = transport.bytesSent();
+  size_t receivedBefore = transport.bytesReceived();
+
+  for (int i = 0; i < BENCH_ITERATIONS; i++) {
+    unsigned long start = micros();
+    int code = transport.post("/iot/sensor-update", body, true, response, sizeof(response));
+    if (code == 200) {
+      samples[count++] = micros() - start;
+    }
+    vTaskDelay(20 / portTICK_PERIOD_MS);
+  }
+  printBenchResult(label, samples, count, transport.bytesSent() - sentBefore, transport.bytesReceived() - receivedBefore);
+}
+
+static void benchMqttCallback(char* topic, byte* payload, unsigned int length) {
+  (void) payload;
+  (void) length;
+  if (strcmp(topic, BENCH_MQTT_TOPIC) == 0) {
+    benchMqttEchoReceived = true;
+  }
+}
+
+// MQTT loopback through the stand-in's broker: publish to our own subscribed
+// topic. Bytes are counted on the socket like the HTTP leg (connect/subscribe
+// traffic excluded).
+static void benchMqtt(const char* body) {
+  uint32_t samples[BENCH_ITERATIONS];
+  int count = 0;
+
+  benchMqttClient.setServer(BENCH_HOST, BENCH_MQTT_PORT);
+  benchMqttClient.setCallback(benchMqttCallback);
+  benchMqttClient.setBufferSize(512);
+  if (!benchMqttClient.connect(DEVICE_ID "-bench") || !benchMqttClient.subscribe(BENCH_MQTT_TOPIC)) {
+    Serial.println("[BENCH] mqtt  ✗ stand-in broker unreachable");
+    return;
+  }
+  size_t sentBefore = benchMqttNet.sent;
+  size_t receivedBefore = benchMqttNet.received;
+
+  for (int i = 0; i < BENCH_ITERATIONS && benchMqttClient.connected(); i++) {
+    benchMqttEchoReceived = false;
+    unsigned long start = micros();
+    benchMqttClient.publish(BENCH_MQTT_TOPIC, body);
+    while (!benchMqttEchoReceived && micros() - start < 2000000UL) {
+      benchMqttClient.loop();
+      if (!benchMqttEchoReceived) {
+        vTaskDelay(1);
+      }
+    }
+    if (benchMqttEchoReceived) {
+      samples[count++] = micros() - start;
+    }
+    vTaskDelay(20 / portTICK_PERIOD_MS);
+  }
+  printBenchResult("mqtt", samples, count, benchMqttNet.sent - sentBefore, benchMqttNet.received - receivedBefore);
+  benchMqttClient.disconnect();
+}
+
+void onBenchmarkTimer(int arg) {
+  (void) arg;
+  postNetJob(NET_JOB_BENCHMARK, NULL, 0);
+}
+
+void runTransportBenchmark() {
+  const char* body = "{\"deviceId\":\"" DEVICE_ID "\",\"slotNumber\":1,\"sensorIndex\":0,\"value\":\"occupied\",\"seq\":1,\"ts\":0}";
+
+  Serial.printf("[BENCH] %d round trips per transport against %s, body %u B\n",
+                BENCH_ITERATIONS, BENCH_HOST, (unsigned) strlen(body));
+  benchTransport(benchHttpTransport, "http", body);
+  benchTransport(benchCoapTransport, "coap", body);
+  benchMqtt(body);
+}
+#else
+void onBenchmarkTimer(int arg) {
+  (void) arg;
+}
+
+void runTransportBenchmark() {
+}
+#endif
+
+// ==================== PERSISTENCE ====================
+
+uint32_t persistCrc(const PersistedState& state) {
+  return esp_rom_crc32_le(0, (const uint8_t*) &state, offsetof(PersistedState, crc));
+}
+
+bool persistValid(const PersistedState& state) {
+  return state.magic == PERSIST_MAGIC && state.crc == persistCrc(state);
+}
+
+void captureState(PersistedState& state) {
+  memset(&state, 0, sizeof(state));
+  state.magic = PERSIST_MAGIC;
+  state.reservedSlot = reservedSlotNumber;
+  state.ledActive = ledActiveForReservedSlot;
+  state.buzzerActive = buzzerActive;
+  state.gateOpen = !gateIsClosed();
+  portENTER_CRITICAL(&traceMux);
+  memcpy(state.traceId, currentTraceId, sizeof(state.traceId));
+  portEXIT_CRITICAL(&traceMux);
+  state.crc = persistCrc(state);
+}
+
+// Called from markStateChanged(): the RTC copy is updated right away, NVS
+// (flash) shortly after and only when the critical fields actually differ.
+void persistState() {
+  PersistedState state;
+  captureState(state);
+  portENTER_CRITICAL(&persistMux);
+  rtcState.state = state;
+  portEXIT_CRITICAL(&persistMux);
+  timerStart(TIMER_PERSIST, onPersistTimer, 0, PERSIST_NVS_COALESCE, 0);
+}
+
+void onPersistTimer(int arg) {
+  (void) arg;
+  postNetJob(NET_JOB_PERSIST, NULL, 0);   // flash write stalls the caller
+}
+
+void writePersistedState() {
+  PersistedState state;
+  portENTER_CRITICAL(&persistMux);
+  state = rtcState.state;
+  portEXIT_CRITICAL(&persistMux);
+
+  // Written on change, and re-stamped while something is live so the copy's
+  // age tells restoreState() how long the outage was. Threshold is half the
+  // heartbeat period: a copy written just after a tick is still re-stamped
+  // on the next one, so it is never more than one period old.
+  uint32_t nowSec = (uint32_t) (wallClockMs() / 1000);
+  bool changed = memcmp(&state, &nvsState, offsetof(PersistedState, savedAtSec)) != 0;
+  bool live = state.ledActive || state.gateOpen;
+  if (!changed && !(live && nowSec != 0 && nowSec - nvsState.savedAtSec >= PERSIST_NVS_HEARTBEAT / 2000)) {
+    return;
+  }
+  state.savedAtSec = nowSec;
+  state.crc = persistCrc(state);
+  preferences.putBytes("state", &state, sizeof(state));
+  nvsState = state;
+}
+
+// Runs first thing in setup(). RTC memory wins if it survived the reset
+// (it is garbage after power-on); otherwise fall back to the NVS copy.
+// The NVS copy can be from any length of outage and there is no wall clock
+// yet to tell: only its gate position is applied now (held open, never
+// dropped on a car), the reservation waits for onNvsRestoreTimer.
+// Returns true if the gate was not closed when the controller went down.
+bool restoreState() {
+  resetReason = esp_reset_reason();
+  preferences.begin("parqeer", false);
+  if (preferences.getBytes("state", &nvsState, sizeof(nvsState)) != sizeof(nvsState) || !persistValid(nvsState)) {
+    memset(&nvsState, 0, sizeof(nvsState));
+  }
+
+  PersistedState state;
+  if (resetReason != ESP_RST_POWERON && persistValid(rtcState.state)) {
+    state = rtcState.state;
+    restoreSource = RESTORE_RTC;
+    memcpy(messageSeq, rtcState.messageSeq, sizeof(messageSeq));   // seq continues, no gap at the backend
+  } else if (persistValid(nvsState)) {
+    state = nvsState;
+    restoreSource = RESTORE_NVS;
+    memset(rtcState.messageSeq, 0, sizeof(rtcState.messageSeq));  // seq restarts at 1
+  } else {
+    restoreSource = RESTORE_NONE;
+    memset(rtcState.messageSeq, 0, sizeof(rtcState.messageSeq));
+    captureState(rtcState.state);
+    return false;
+  }
+
+  if (restoreSource == RESTORE_NVS && state.ledActive) {
+    nvsPendingState = state;
+    nvsRestorePending = true;
+    state.reservedSlot = -1;
+    state.ledActive = 0;
+    state.buzzerActive = 0;
+    state.traceId[0] = '\0';
+    state.crc = persistCrc(state);
+    timerStart(TIMER_NVS_RESTORE, onNvsRestoreTimer, 0, 1000, 1000);
+  }
+  applyRestoredState(state);
+  rtcState.state = state;
+
+  Serial.printf("✓ State restored from %s: reservedSlot=%d led=%s buzzer=%s gate=%s%s\n",
+                RESTORE_SOURCE_NAMES[restoreSource], reservedSlotNumber,
+                indicatorLedOn ? "on" : "off", buzzerActive ? "on" : "off",
+                state.gateOpen ? "open" : "closed",
+                nvsRestorePending ? " (NVS reservation waits for the clock)" : "");
+  return state.gateOpen;
+}
+
+void applyRestoredState(const PersistedState& state) {
+  if (state.reservedSlot >= 1 && state.reservedSlot <= 4 && state.ledActive) {
+    reservedSlotNumber = state.reservedSlot;
+    ledActiveForReservedSlot = true;
+    indicatorLedOn = true;
+    ledTurnedOnTime = millis();
+    buzzerActive = state.buzzerActive;
+    buzzerActivationTime = millis();
+  }
+  if (reservedSlotNumber != -1 || state.gateOpen) {
+    portENTER_CRITICAL(&traceMux);
+    memcpy(currentTraceId, state.traceId, sizeof(currentTraceId));
+    currentTraceId[sizeof(currentTraceId) - 1] = '\0';
+    portEXIT_CRITICAL(&traceMux);
+  }
+}
+
+// Polls (1 s) until SNTP has synced, then keeps the NVS reservation only if
+// the copy is recent enough that the outage was short. Dropped if the clock
+// never comes up or a new voucher was entered in the meantime.
+void onNvsRestoreTimer(int arg) {
+  (void) arg;
+  uint64_t nowMs = wallClockMs();
+  if (nowMs == 0 && millis() < PERSIST_CLOCK_WAIT) {
+    return;
+  }
+  timerCancel(TIMER_NVS_RESTORE);
+  nvsRestorePending = false;
+
+  // validateVoucher stores the backend's slotNumber unchecked (0 if missing)
+  int slot = nvsPendingState.reservedSlot;
+  if (slot < 1 || slot > 4) {
+    Serial.printf("✗ NVS reservation for invalid slot %d dropped\n", slot);
+    markStateChanged();
+    return;
+  }
+
+  uint32_t nowSec = (uint32_t) (nowMs / 1000);
+  uint32_t savedAtSec = nvsPendingState.savedAtSec;
+  if (nowSec == 0 || savedAtSec == 0 || nowSec < savedAtSec ||
+      nowSec - savedAtSec > PERSIST_NVS_MAX_AGE_SEC || reservedSlotNumber != -1) {
+    Serial.printf("✗ NVS reservation for slot %d dropped (saved %lus ago)\n",
+                  nvsPendingState.reservedSlot,
+                  (unsigned long) (nowSec != 0 && savedAtSec != 0 && nowSec >= savedAtSec ? nowSec - savedAtSec : 0));
+    markStateChanged();   // overwrite the stale flash copy
+    return;
+  }
+
+  applyRestoredState(nvsPendingState);
+  digitalWrite(indicatorLedPin, indicatorLedOn ? HIGH : LOW);
+  digitalWrite(buzzerPin, buzzerActive ? HIGH : LOW);
+  Serial.printf("✓ NVS reservation for slot %d restored (saved %lus ago)\n",
+                reservedSlotNumber, (unsigned long) (nowSec - savedAtSec));
+  // Car already in the slot: replay its edge so TaskSensors completes the arrival
+  if (reservedSlotNumber >= 1 && reservedSlotNumber <= 4 && sensorStates[reservedSlotNumber - 1]) {
+    sensorStates[reservedSlotNumber - 1] = false;
+  }
+  markStateChanged();
+}
+
+const char* resetReasonName(esp_reset_reason_t reason) {
+  switch (reason) {
+    case ESP_RST_POWERON:   return "poweron";
+    case ESP_RST_EXT:       return "external";
+    case ESP_RST_SW:        return "software";
+    case ESP_RST_PANIC:     return "panic";
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:       return "watchdog";
+    case ESP_RST_DEEPSLEEP: return "deepsleep";
+    case ESP_RST_BROWNOUT:  return "brownout";
+    default:                return "unknown";
+  }
+}
+
+// ---------- Boot timing ----------
+
+// First report carrying real sensor readings left the device (HTTP or MQTT)
+void markSensorReported() {
+  if (bootFirstSensorReportUs == 0) {
+    bootFirstSensorReportUs = esp_timer_get_time();
+  }
+}
+
+// Once per boot, on the first MQTT connect (after the state snapshot)
+void publishBootReport() {
+  if (bootReportPublished) {
+    return;
+  }
+  bootReportPublished = true;
+
+  Serial.printf("[BOOT] reset=%s restore=%s gate-ready=%lu ms wifi=%lu ms first-sensor-report=%lu ms\n",
+                resetReasonName(resetReason), RESTORE_SOURCE_NAMES[restoreSource],
+                (unsigned long) (bootGateReadyUs / 1000), (unsigned long) (bootWifiConnectedUs / 1000),
+                (unsigned long) (bootFirstSensorReportUs / 1000));
+
+  StaticJsonDocument<384> doc;
+  doc["deviceId"] = DEVICE_ID;
+  doc["resetReason"] = resetReasonName(resetReason);
+  doc["restoredFrom"] = RESTORE_SOURCE_NAMES[restoreSource];
+  doc["gateReadyMs"] = (unsigned long) (bootGateReadyUs / 1000);
+  doc["wifiConnectedMs"] = (unsigned long) (bootWifiConnectedUs / 1000);
+  doc["firstSensorReportMs"] = (unsigned long) (bootFirstSensorReportUs / 1000);
+  stampMessage(doc, CHANNEL_MQTT, wallClockMs());
+  char buffer[320];
+  serializeJson(doc, buffer, sizeof(buffer));
+  const char* topic = "parking/device/boot";
+  mqttPublish(topic, buffer);   // not retained: one event per boot, never replayed
+  Serial.print("✓ Published to ");
+  Serial.println(topic);
+}
+
 // ==================== UTILITY FUNCTIONS ====================
 
-void logLedEvent(String state, int slotNumber, String reason) {
+void logLedEvent(const char* state, int slotNumber, const char* reason) {
   // Log format: [HH:MM:SS] LED [ON/OFF] - Slot: X - Reason: ...
-  unsigned long uptime = millis() / 1000;
-  unsigned int hours = (uptime / 3600) % 24;
-  unsigned int minutes = (uptime / 60) % 60;
-  unsigned int seconds = uptime % 60;
-  
-  Serial.print("[");
-  if (hours < 10) Serial.print("0");
-  Serial.print(hours);
-  Serial.print(":");
-  if (minutes < 10) Serial.print("0");
-  Serial.print(minutes);
-  Serial.print(":");
-  if (seconds < 10) Serial.print("0");
-  Serial.print(seconds);
-  Serial.print("] ");
+  uint64_t eventMs = wallClockMs();
+  
+  printLogTimestamp();
   Serial.print("LED [");
   Serial.print(state);
   Serial.print("] - Slot: ");
@@ -819,39 +2958,27 @@ void logLedEvent(String state, int slotNumber, String reason) {
   Serial.println(reason);
   
   // Optional: Send LED log to backend via MQTT
-  if (mqttClient.connected()) {
-    StaticJsonDocument<256> logPayload;
-    logPayload["timestamp"] = uptime;
+  if (mqttIsConnected()) {
+    StaticJsonDocument<384> logPayload;
     logPayload["ledState"] = state;
     logPayload["slotNumber"] = slotNumber;
     logPayload["reason"] = reason;
-    logPayload["deviceId"] = "esp32-main";
+    logPayload["deviceId"] = DEVICE_ID;
+    stampMessage(logPayload, CHANNEL_MQTT, eventMs);
     
-    char buffer[256];
+    char buffer[320];
     serializeJson(logPayload, buffer, sizeof(buffer));
     
     const char* topic = "parking/led/log";
-    mqttClient.publish(topic, buffer);
+    mqttPublish(topic, buffer);
   }
 }
 
-void logBuzzerEvent(String state, int slotNumber, String reason) {
+void logBuzzerEvent(const char* state, int slotNumber, const char* reason) {
   // Log format: [HH:MM:SS] BUZZER [ON/OFF/PAUSED] - Slot: X - Reason: ...
-  unsigned long uptime = millis() / 1000;
-  unsigned int hours = (uptime / 3600) % 24;
-  unsigned int minutes = (uptime / 60) % 60;
-  unsigned int seconds = uptime % 60;
-  
-  Serial.print("[");
-  if (hours < 10) Serial.print("0");
-  Serial.print(hours);
-  Serial.print(":");
-  if (minutes < 10) Serial.print("0");
-  Serial.print(minutes);
-  Serial.print(":");
-  if (seconds < 10) Serial.print("0");
-  Serial.print(seconds);
-  Serial.print("] ");
+  uint64_t eventMs = wallClockMs();
+  
+  printLogTimestamp();
   Serial.print("🔔 BUZZER [");
   Serial.print(state);
   Serial.print("] - Slot: ");
@@ -860,20 +2987,97 @@ void logBuzzerEvent(String state, int slotNumber, String reason) {
   Serial.println(reason);
   
   // Send buzzer log to backend via MQTT
-  if (mqttClient.connected()) {
-    StaticJsonDocument<256> logPayload;
-    logPayload["timestamp"] = uptime;
+  if (mqttIsConnected()) {
+    StaticJsonDocument<384> logPayload;
     logPayload["buzzerState"] = state;
     logPayload["slotNumber"] = slotNumber;
     logPayload["reason"] = reason;
-    logPayload["deviceId"] = "esp32-main";
+    logPayload["deviceId"] = DEVICE_ID;
+    stampMessage(logPayload, CHANNEL_MQTT, eventMs);
     
-    char buffer[256];
+    char buffer[320];
     serializeJson(logPayload, buffer, sizeof(buffer));
     
     const char* topic = "parking/buzzer/log";
-    mqttClient.publish(topic, buffer);
+    mqttPublish(topic, buffer);
+  }
+}
+
+// Prints "[HH:MM:SS] " in local time once SNTP has synced, else uptime
+// (hours not wrapped, so multi-day uptimes stay unambiguous).
+void printLogTimestamp() {
+  unsigned long hours, minutes, seconds;
+  time_t now = time(NULL);
+  struct tm localTime;
+  if (wallClockMs() > 0 && localtime_r(&now, &localTime) != NULL) {
+    hours = localTime.tm_hour;
+    minutes = localTime.tm_min;
+    seconds = localTime.tm_sec;
+  } else {
+    unsigned long uptime = millis() / 1000;
+    hours = uptime / 3600;
+    minutes = (uptime / 60) % 60;
+    seconds = uptime % 60;
+  }
+  Serial.printf("[%02lu:%02lu:%02lu] ", hours, minutes, seconds);
+}
+
+// ==================== TRACING ====================
+
+// Epoch milliseconds from SNTP, or 0 while the clock is not synced yet.
+uint64_t wallClockMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec < 1700000000) {
+    return 0;
+  }
+  return (uint64_t) tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+}
+
+// Adds seq / ts / uptimeMs / traceId to an outbound message. `eventMs` is
+// the wall-clock time of the originating edge event, not the send time;
+// `traceIdAtEvent` (queued messages) replaces the live trace, which may
+// have ended by the time the message goes out.
+void stampMessage(JsonDocument& doc, int channel, uint64_t eventMs, const char* traceIdAtEvent) {
+  char traceId[sizeof(currentTraceId)];
+  uint32_t seq;
+
+  portENTER_CRITICAL(&traceMux);
+  seq = ++messageSeq[channel];
+  rtcState.messageSeq[channel] = seq;
+  memcpy(traceId, traceIdAtEvent != NULL ? traceIdAtEvent : currentTraceId, sizeof(traceId));
+  portEXIT_CRITICAL(&traceMux);
+  traceId[sizeof(traceId) - 1] = '\0';
+
+  doc["seq"] = seq;
+  doc["ts"] = eventMs;
+  doc["uptimeMs"] = millis();
+  if (traceId[0] != '\0') {
+    doc["traceId"] = (char*) traceId;   // char* → ArduinoJson copies it
+  }
+}
+
+// New admission: the trace ID follows the voucher through gate and slot messages
+void beginTrace() {
+  char traceId[sizeof(currentTraceId)];
+  snprintf(traceId, sizeof(traceId), "%08lx%08lx", (unsigned long) esp_random(), (unsigned long) esp_random());
+
+  portENTER_CRITICAL(&traceMux);
+  memcpy(currentTraceId, traceId, sizeof(currentTraceId));
+  portEXIT_CRITICAL(&traceMux);
+
+  Serial.print("Trace ");
+  Serial.println(traceId);
+}
+
+// The admission is over once the gate is down and no reservation is pending
+void endTraceIfIdle() {
+  if (!gateIsClosed() || ledActiveForReservedSlot) {
+    return;
   }
+  portENTER_CRITICAL(&traceMux);
+  currentTraceId[0] = '\0';
+  portEXIT_CRITICAL(&traceMux);
 }
 
 void blinkSuccess() {
@@ -0,0 +1,224 @@
+// LAN stand-in for the firmware transport benchmark (TRANSPORT_BENCHMARK=1).
+// Answers the same /api/v1/iot/* POSTs over plain HTTP (:8080) and plain CoAP
+// (:5683) with a fixed JSON body, and runs a minimal MQTT 3.1.1 broker (:1883,
+// QoS 0, exact-topic subscriptions) for the loopback leg, so all three legs
+// cross the same LAN hop and the ESP32 measures the transports rather than
+// the database or a cloud broker. Node has no DTLS, so coaps is not covered.
+//
+//   node scripts/coap-standin.js            (or: npm run coap-standin)
+
+const dgram = require('dgram');
+const http = require('http');
+const net = require('net');
+
+const HTTP_PORT = Number(process.env.BENCH_HTTP_PORT || 8080);
+const COAP_PORT = Number(process.env.BENCH_COAP_PORT || 5683);
+const MQTT_PORT = Number(process.env.BENCH_MQTT_PORT || 1883);
+const REPLY = JSON.stringify({ success: true, message: 'ok' });
+
+const stats = {
+  http: { requests: 0, bytesIn: 0, bytesOut: 0 },
+  coap: { requests: 0, bytesIn: 0, bytesOut: 0 },
+  mqtt: { requests: 0, bytesIn: 0, bytesOut: 0 },
+};
+
+// ---------- HTTP ----------
+
+const httpServer = http.createServer((req, res) => {
+  let body = '';
+  req.on('data', (chunk) => { body += chunk; });
+  req.on('end', () => {
+    if (req.method !== 'POST' || !req.url.startsWith('/api/v1/iot/')) {
+      res.writeHead(404).end();
+      return;
+    }
+    res.writeHead(200, { 'Content-Type': 'application/json', 'Content-Length': Buffer.byteLength(REPLY) });
+    res.end(REPLY, () => accountHttpBytes(req.socket));
+    stats.http.requests += 1;
+  });
+});
+
+// Keep-alive: account socket bytes per response instead of per connection
+const accountHttpBytes = (socket) => {
+  const read = socket.bytesRead - (socket.countedRead || 0);
+  const written = socket.bytesWritten - (socket.countedWritten || 0);
+  socket.countedRead = socket.bytesRead;
+  socket.countedWritten = socket.bytesWritten;
+  stats.http.bytesIn += read;
+  stats.http.bytesOut += written;
+};
+
+// ---------- CoAP (RFC 7252, just enough for POST) ----------
+
+const COAP_CON = 0;
+const COAP_NON = 1;
+const COAP_ACK = 2;
+const CODE_CHANGED = (2 << 5) | 4; // 2.04
+const CODE_NOT_FOUND = (4 << 5) | 4; // 4.04
+const OPTION_URI_PATH = 11;
+
+const parseCoap = (msg) => {
+  if (msg.length < 4 || msg[0] >> 6 !== 1) return null;
+  const type = (msg[0] >> 4) & 0x03;
+  const tokenLength = msg[0] & 0x0f;
+  const token = msg.subarray(4, 4 + tokenLength);
+  const path = [];
+  let pos = 4 + tokenLength;
+  let option = 0;
+
+  const extended = (nibble) => {
+    if (nibble === 13) return msg[pos++] + 13;
+    if (nibble === 14) { const v = msg.readUInt16BE(pos) + 269; pos += 2; return v; }
+    return nibble;
+  };
+
+  while (pos < msg.length && msg[pos] !== 0xff) {
+    const deltaNibble = msg[pos] >> 4;
+    const lengthNibble = msg[pos] & 0x0f;
+    pos += 1;
+    option += extended(deltaNibble);
+    const length = extended(lengthNibble);
+    if (option === OPTION_URI_PATH) path.push(msg.toString('utf8', pos, pos + length));
+    pos += length;
+  }
+
+  return {
+    type,
+    code: msg[1],
+    messageId: msg.readUInt16BE(2),
+    token,
+    path: `/${path.join('/')}`,
+    payload: pos < msg.length ? msg.subarray(pos + 1) : Buffer.alloc(0),
+  };
+};
+
+const buildCoapResponse = (type, code, messageId, token, payload) => {
+  const header = Buffer.from([0x40 | (type << 4) | token.length, code, messageId >> 8, messageId & 0xff]);
+  const contentFormat = Buffer.from([0xc1, 50]); // Content-Format (12) = application/json
+  return Buffer.concat([header, token, contentFormat, Buffer.from([0xff]), Buffer.from(payload)]);
+};
+
+const coapServer = dgram.createSocket('udp4');
+let nextMessageId = Math.floor(Math.random() * 0xffff);
+
+coapServer.on('message', (msg, rinfo) => {
+  stats.coap.bytesIn += msg.length;
+  const request = parseCoap(msg);
+  if (!request || request.code !== 0x02) return;
+
+  const found = request.path.startsWith('/api/v1/iot/');
+  const code = found ? CODE_CHANGED : CODE_NOT_FOUND;
+  const reply = found ? REPLY : '';
+
+  if (request.type !== COAP_CON && request.type !== COAP_NON) return;
+
+  // CON → piggybacked ACK; NON → NON response with a fresh message ID
+  const response = request.type === COAP_CON
+    ? buildCoapResponse(COAP_ACK, code, request.messageId, request.token, reply)
+    : buildCoapResponse(COAP_NON, code, (nextMessageId = (nextMessageId + 1) & 0xffff), request.token, reply);
+
+  coapServer.send(response, rinfo.port, rinfo.address);
+  stats.coap.requests += 1;
+  stats.coap.bytesOut += response.length;
+});
+
+// ---------- MQTT (3.1.1, just enough for a publish → own-subscription echo) ----------
+
+const MQTT_CONNECT = 1;
+const MQTT_PUBLISH = 3;
+const MQTT_SUBSCRIBE = 8;
+const MQTT_PINGREQ = 12;
+const MQTT_DISCONNECT = 14;
+
+const subscriptions = new Map(); // topic -> Set<socket>
+
+// Returns { type, flags, body, length } for the first complete packet, or null
+const readMqttPacket = (buffer) => {
+  let multiplier = 1;
+  let remaining = 0;
+  let pos = 1;
+  for (;;) {
+    if (pos >= buffer.length) return null;
+    const byte = buffer[pos++];
+    remaining += (byte & 0x7f) * multiplier;
+    if ((byte & 0x80) === 0) break;
+    multiplier *= 128;
+  }
+  if (buffer.length < pos + remaining) return null;
+  return {
+    type: buffer[0] >> 4,
+    flags: buffer[0] & 0x0f,
+    raw: buffer.subarray(0, pos + remaining),
+    body: buffer.subarray(pos, pos + remaining),
+  };
+};
+
+const sendMqtt = (socket, packet) => {
+  socket.write(packet);
+};
+
+const mqttServer = net.createServer((socket) => {
+  let pending = Buffer.alloc(0);
+  const topics = new Set();
+
+  socket.on('data', (chunk) => {
+    pending = Buffer.concat([pending, chunk]);
+    for (let packet = readMqttPacket(pending); packet; packet = readMqttPacket(pending)) {
+      pending = pending.subarray(packet.raw.length);
+      if (packet.type === MQTT_CONNECT) {
+        sendMqtt(socket, Buffer.from([0x20, 0x02, 0x00, 0x00]));
+      } else if (packet.type === MQTT_SUBSCRIBE) {
+        const packetId = packet.body.readUInt16BE(0);
+        const granted = [];
+        for (let pos = 2; pos < packet.body.length;) {
+          const length = packet.body.readUInt16BE(pos);
+          const topic = packet.body.toString('utf8', pos + 2, pos + 2 + length);
+          pos += 2 + length + 1;
+          if (!subscriptions.has(topic)) subscriptions.set(topic, new Set());
+          subscriptions.get(topic).add(socket);
+          topics.add(topic);
+          granted.push(0x00);
+        }
+        sendMqtt(socket, Buffer.from([0x90, 2 + granted.length, packetId >> 8, packetId & 0xff, ...granted]));
+      } else if (packet.type === MQTT_PUBLISH) {
+        const length = packet.body.readUInt16BE(0);
+        const topic = packet.body.toString('utf8', 2, 2 + length);
+        stats.mqtt.requests += 1;
+        stats.mqtt.bytesIn += packet.raw.length;
+        // QoS 0 only: the incoming packet is forwarded unchanged
+        (subscriptions.get(topic) || []).forEach((subscriber) => {
+          sendMqtt(subscriber, packet.raw);
+          stats.mqtt.bytesOut += packet.raw.length;
+        });
+      } else if (packet.type === MQTT_PINGREQ) {
+        sendMqtt(socket, Buffer.from([0xd0, 0x00]));
+      } else if (packet.type === MQTT_DISCONNECT) {
+        socket.end();
+      }
+    }
+  });
+
+  socket.on('close', () => {
+    topics.forEach((topic) => subscriptions.get(topic)?.delete(socket));
+  });
+  socket.on('error', () => {});
+});
+
+// ---------- Stats ----------
+
+const printStats = () => {
+  Object.entries(stats).forEach(([name, s]) => {
+    if (s.requests === 0) return;
+    console.log(
+      `[standin] ${name.padEnd(4)} requests=${s.requests} ` +
+      `bytes/req in=${(s.bytesIn / s.requests).toFixed(1)} out=${(s.bytesOut / s.requests).toFixed(1)}`
+    );
+  });
+};
+
+setInterval(printStats, 10000).unref();
+process.on('SIGINT', () => { printStats(); process.exit(0); });
+
+httpServer.listen(HTTP_PORT, () => console.log(`[standin] HTTP on :${HTTP_PORT}`));
+coapServer.bind(COAP_PORT, () => console.log(`[standin] CoAP on udp :${COAP_PORT}`));
+mqttServer.listen(MQTT_PORT, () => console.log(`[standin] MQTT on :${MQTT_PORT}`));
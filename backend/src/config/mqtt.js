@@ -78,13 +78,13 @@ const subscribe = (topic, handler) => {
       logger.error('MQTT subscribe failed', { topic, error: err.message });
     }
   });
-  client.on('message', (incomingTopic, message) => {
+  client.on('message', (incomingTopic, message, packet) => {
     if (!matches(topic, incomingTopic)) return;
     try {
       const rawPayload = message.toString();
       logger.info('MQTT message received', { topic: incomingTopic, payload: rawPayload });
       const parsed = JSON.parse(rawPayload);
-      handler(parsed, incomingTopic);
+      handler(parsed, incomingTopic, packet);
     } catch (error) {
       logger.error('MQTT message parse error', { topic: incomingTopic, error: error.message });
     }
@@ -1,7 +1,7 @@
 const dotenv = require('dotenv');
 const jwt = require('jsonwebtoken');
 const { query } = require('../config/db');
-const { pushSlotCounts, sendGateCommand } = require('../services/mqttBridge.service');
+const { pushSlotCounts, sendGateCommand, getLatestSnapshot } = require('../services/mqttBridge.service');
 
 dotenv.config();
 
@@ -20,7 +20,12 @@ const getOverview = async (req, res, next) => {
     const lastDeviceLogs = await query(
       'SELECT id, deviceId, type, payload, createdAt FROM device_logs ORDER BY createdAt DESC LIMIT 5'
     );
-    res.json({ totals, lastTransactions: lastTransactions.rows, lastDeviceLogs: lastDeviceLogs.rows });
+    res.json({
+      totals,
+      lotState: getLatestSnapshot(),
+      lastTransactions: lastTransactions.rows,
+      lastDeviceLogs: lastDeviceLogs.rows
+    });
   } catch (error) {
     next(error);
   }
@@ -3,6 +3,7 @@ const { query } = require('../config/db');
 const { getVoucherByCode, markVoucherUsed } = require('../services/voucher.service');
 const { getActiveGateSession, createGateSession } = require('../services/gateSession.service');
 const { processGateSensorEvent } = require('../services/gateManager.service');
+const { recordDeviceTrace } = require('../services/deviceTrace.service');
 const {
   pushSlotCounts,
   sendGateCommand,
@@ -34,6 +35,7 @@ const validateVoucher = async (req, res, next) => {
       return res.status(401).json({ message: 'Unauthorized device' });
     }
     const { code, deviceId } = req.body;
+    const trace = recordDeviceTrace('http', req.body);
     const activeSession = await getActiveGateSession();
     if (activeSession) {
       return res.status(409).json({ valid: false, message: 'Gate is currently in use' });
@@ -62,7 +64,7 @@ const validateVoucher = async (req, res, next) => {
     await createGateSession({ voucherId: voucher.id, slotId: voucher.slotId, slotNumber: voucher.slotNumber });
     await sendGateCommand(voucher.slotNumber, 'open');
     await publishVoucherResponse({ code, valid: true, slotNumber: voucher.slotNumber, action: 'open' });
-    await logDeviceEvent(deviceId || 'esp32', 'voucher-validated', { code, slotNumber: voucher.slotNumber });
+    await logDeviceEvent(deviceId || 'esp32', 'voucher-validated', { code, slotNumber: voucher.slotNumber, trace });
     res.json({ valid: true, slotNumber: voucher.slotNumber, action: 'open' });
   } catch (error) {
     next(error);
@@ -75,6 +77,7 @@ const handleSensorUpdate = async (req, res, next) => {
       return res.status(401).json({ message: 'Unauthorized device' });
     }
     const { deviceId, slotNumber, sensorIndex, value } = req.body;
+    const trace = recordDeviceTrace('http', req.body);
     const slotResult = await query('SELECT id, slotnumber AS "slotNumber", status FROM slots WHERE slotnumber = $1', [slotNumber]);
     const slot = slotResult.rows[0];
     if (!slot) {
@@ -84,7 +87,7 @@ const handleSensorUpdate = async (req, res, next) => {
     if (slot.status !== nextStatus) {
       await query('UPDATE slots SET status = $1, updatedAt = now() WHERE id = $2', [nextStatus, slot.id]);
     }
-    await logDeviceEvent(deviceId || 'esp32', 'sensor-update', { slotNumber, sensorIndex, value });
+    await logDeviceEvent(deviceId || 'esp32', 'sensor-update', { slotNumber, sensorIndex, value, trace });
     await announceSensorStatus(slotNumber, nextStatus);
     await pushSlotCounts();
     await processGateSensorEvent(slotNumber, nextStatus, req.app);
@@ -104,7 +107,8 @@ const servoCallback = async (req, res, next) => {
       return res.status(401).json({ message: 'Unauthorized device' });
     }
     const { deviceId, servoState } = req.body;
-    await logDeviceEvent(deviceId || 'esp32', 'servo-callback', { servoState });
+    const trace = recordDeviceTrace('http', req.body);
+    await logDeviceEvent(deviceId || 'esp32', 'servo-callback', { servoState, trace });
     res.json({ ok: true });
   } catch (error) {
     next(error);
@@ -0,0 +1,31 @@
+const { logger } = require('../utils/logger');
+
+// Last sequence number seen per `${deviceId}:${channel}` (http | mqtt)
+const lastSeqByStream = new Map();
+
+// Checks ordering of a device message and returns trace metadata for device_logs.
+// Firmware stamps every message with { seq, ts, traceId }; seq restarts at 1 on reboot.
+const recordDeviceTrace = (channel, payload = {}) => {
+  const { deviceId = 'esp32', seq, ts, traceId } = payload || {};
+  if (!Number.isInteger(seq)) return {};
+
+  const receivedAt = Date.now();
+  const key = `${deviceId}:${channel}`;
+  const lastSeq = lastSeqByStream.get(key);
+
+  if (lastSeq !== undefined && seq !== 1) {
+    if (seq <= lastSeq) {
+      logger.warn('Device message reordered or duplicated', { deviceId, channel, seq, lastSeq, traceId });
+    } else if (seq > lastSeq + 1) {
+      logger.warn('Device message gap', { deviceId, channel, seq, lastSeq, missing: seq - lastSeq - 1, traceId });
+    }
+  }
+  if (lastSeq === undefined || seq === 1 || seq > lastSeq) {
+    lastSeqByStream.set(key, seq);
+  }
+
+  const latencyMs = ts > 0 ? receivedAt - ts : null;
+  return { seq, traceId: traceId || null, edgeTs: ts > 0 ? ts : null, latencyMs };
+};
+
+module.exports = { recordDeviceTrace };
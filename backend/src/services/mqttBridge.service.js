@@ -3,6 +3,7 @@ const { query } = require('../config/db');
 const { getVoucherByCode, markVoucherUsed } = require('./voucher.service');
 const { processGateSensorEvent } = require('./gateManager.service');
 const { getActiveGateSession, createGateSession, completeGateSession } = require('./gateSession.service');
+const { recordDeviceTrace } = require('./deviceTrace.service');
 const { logger } = require('../utils/logger');
 
 const logDeviceEvent = async (deviceId, type, payload) => {
@@ -22,19 +23,23 @@ const sendGateCommand = (slotNumber, command) => {
   return publish(topic, { slotNumber, command });
 };
 
+const summarizeSlots = (rows) => ({
+  type: 'slot-summary',
+  available: rows.filter((row) => row.status === 'available').length,
+  reserved: rows.filter((row) => row.status === 'reserved').length,
+  occupied: rows.filter((row) => row.status === 'occupied').length
+});
+
 const pushSlotCounts = async () => {
-  const availableResult = await query("SELECT COUNT(*)::INT AS count FROM slots WHERE status = 'available'");
-  const reservedResult = await query("SELECT COUNT(*)::INT AS count FROM slots WHERE status = 'reserved'");
-  const occupiedResult = await query("SELECT COUNT(*)::INT AS count FROM slots WHERE status = 'occupied'");
-  const summary = {
-    type: 'slot-summary',
-    available: availableResult.rows[0]?.count || 0,
-    reserved: reservedResult.rows[0]?.count || 0,
-    occupied: occupiedResult.rows[0]?.count || 0
-  };
-  await publishSystemNotify(summary);
+  const result = await query('SELECT status FROM slots');
+  await publishSystemNotify(summarizeSlots(result.rows));
 };
 
+// Latest retained full-state document per device (see parking/state)
+const latestSnapshots = new Map();
+
+const getLatestSnapshot = (deviceId = 'esp32-main') => latestSnapshots.get(deviceId) || null;
+
 const announceVoucher = async (code, slotNumber) => {
   await publishSystemNotify({ type: 'voucher-created', code, slotNumber });
 };
@@ -79,6 +84,7 @@ const handleVoucherCheck = async (payload, app) => {
 };
 
 const handleSlotStatus = async (topic, payload, app) => {
+  const trace = recordDeviceTrace('mqtt', payload);
   const [, , slotNumberPart] = topic.split('/');
   const slotNumber = Number(slotNumberPart);
   if (!slotNumber) return;
@@ -97,12 +103,13 @@ const handleSlotStatus = async (topic, payload, app) => {
   if (io) {
     io.emit('slotUpdate', { slotNumber, status: nextStatus });
   }
-  await logDeviceEvent(payload?.deviceId || 'esp32', 'sensor-update-mqtt', { slotNumber, status: nextStatus });
+  await logDeviceEvent(payload?.deviceId || 'esp32', 'sensor-update-mqtt', { slotNumber, status: nextStatus, trace });
 };
 
 const handleGateState = async (payload, app) => {
+  const trace = recordDeviceTrace('mqtt', payload);
   await publishSystemNotify({ type: 'gate-state', ...payload });
-  await logDeviceEvent(payload?.deviceId || 'esp32', 'gate-state', payload);
+  await logDeviceEvent(payload?.deviceId || 'esp32', 'gate-state', { ...payload, trace });
 
   if ((payload?.state || '').toLowerCase() === 'closed') {
     const activeSession = await getActiveGateSession();
@@ -117,6 +124,77 @@ const handleGateState = async (payload, app) => {
   }
 };
 
+// The device republishes its snapshot at least every 5 min while online, so a
+// retained one older than this means the device has been offline since.
+const STATE_SNAPSHOT_MAX_AGE_MS = Number(process.env.STATE_SNAPSHOT_MAX_AGE_MS || 10 * 60 * 1000);
+
+const handleStateSnapshot = async (payload, app, packet) => {
+  const deviceId = payload?.deviceId || 'esp32';
+  if (packet?.retain) {
+    // Broker replay on (re)subscribe: only trust it if it is recent. ts is 0
+    // when the device had no SNTP time yet, so its age is unknown.
+    const ageMs = payload?.ts > 0 ? Date.now() - payload.ts : null;
+    if (ageMs === null || ageMs > STATE_SNAPSHOT_MAX_AGE_MS) {
+      logger.warn('Ignoring stale retained lot state', { deviceId, version: payload?.version, ageMs });
+      return;
+    }
+  }
+  const trace = recordDeviceTrace('mqtt', payload);
+  const previous = latestSnapshots.get(deviceId);
+  // Versions restart after a device reboot; uptime going backwards marks that
+  const rebooted = previous && payload.uptimeMs < previous.uptimeMs;
+  if (previous && !rebooted && payload.version <= previous.version) {
+    return;
+  }
+  latestSnapshots.set(deviceId, payload);
+
+  // One read + only the writes that actually differ, instead of per-slot resync queries.
+  // Device only knows occupied/available, so a DB 'reserved' slot stays reserved until occupied.
+  const slotResult = await query('SELECT id, slotnumber AS "slotNumber", status FROM slots');
+  const rows = slotResult.rows;
+  const changed = [];
+  for (const deviceSlot of payload.slots || []) {
+    const row = rows.find((candidate) => candidate.slotNumber === deviceSlot.slotNumber);
+    if (!row || row.status === deviceSlot.status) continue;
+    if (row.status === 'reserved' && deviceSlot.status === 'available') continue;
+    await query('UPDATE slots SET status = $1, updatedAt = now() WHERE id = $2', [deviceSlot.status, row.id]);
+    row.status = deviceSlot.status;
+    changed.push(row);
+  }
+  await publishSystemNotify(summarizeSlots(rows));
+
+  // Same fan-out as a per-slot sensor update, so dashboards (slotUpdate) see
+  // changes that only arrived through the snapshot (e.g. made while offline).
+  // The snapshot can't tell when a car entered, so only the admitted car
+  // reaching its slot completes the gate session; no wrong-slot signalling.
+  const io = app?.get('io');
+  const session = changed.length > 0 ? await getActiveGateSession() : null;
+  for (const row of changed) {
+    await announceSensorStatus(row.slotNumber, row.status);
+    if (session && row.slotNumber === session.slotNumber && row.status === 'occupied') {
+      await processGateSensorEvent(row.slotNumber, row.status, app);
+    }
+    if (io) {
+      io.emit('slotUpdate', { slotNumber: row.slotNumber, status: row.status });
+    }
+  }
+  if (io) {
+    io.emit('lotState', payload);
+  }
+  logger.info('Lot state snapshot applied', { deviceId, version: payload.version, changedSlots: changed.length, trace });
+};
+
+const handleDeviceBoot = async (payload, packet) => {
+  // One event per boot; a retained copy (older firmware) would be re-logged on every reconnect
+  if (packet?.retain) return;
+  const trace = recordDeviceTrace('mqtt', payload);
+  const deviceId = payload?.deviceId || 'esp32';
+  const { resetReason, restoredFrom, gateReadyMs, wifiConnectedMs, firstSensorReportMs } = payload || {};
+  const log = resetReason === 'brownout' || resetReason === 'panic' || resetReason === 'watchdog' ? logger.warn : logger.info;
+  log('Device booted', { deviceId, resetReason, restoredFrom, gateReadyMs, wifiConnectedMs, firstSensorReportMs });
+  await logDeviceEvent(deviceId, 'boot', { resetReason, restoredFrom, gateReadyMs, wifiConnectedMs, firstSensorReportMs, trace });
+};
+
 const initMqttBridge = (app) => {
   subscribe('parking/voucher/check', (payload) => {
     handleVoucherCheck(payload, app).catch((error) => logger.error('Voucher check MQTT failed', { error: error.message }));
@@ -129,10 +207,24 @@ const initMqttBridge = (app) => {
   subscribe('parking/gate/state', (payload) => {
     handleGateState(payload, app).catch((error) => logger.error('Gate state MQTT failed', { error: error.message }));
   });
+
+  subscribe('parking/state', (payload, topic, packet) => {
+    handleStateSnapshot(payload, app, packet).catch((error) => logger.error('State snapshot MQTT failed', { error: error.message }));
+  });
+
+  subscribe('parking/device/boot', (payload, topic, packet) => {
+    handleDeviceBoot(payload, packet).catch((error) => logger.error('Device boot MQTT failed', { error: error.message }));
+  });
+
+  // Not acted on, but they share the device's MQTT sequence, so track them for gap detection
+  ['parking/voucher/success', 'parking/voucher/error', 'parking/led/log', 'parking/buzzer/log'].forEach((topic) => {
+    subscribe(topic, (payload) => recordDeviceTrace('mqtt', payload));
+  });
 };
 
 module.exports = {
   pushSlotCounts,
+  getLatestSnapshot,
   announceVoucher,
   sendGateCommand,
   sendIndicatorCommand,